@@ -20,14 +20,9 @@ def to_number(num):
     except:
         raise Exception()
 
+# k_means below works on lists of rows
 def init_vector_list(input_data):
-    vectors = []
-    with open(input_data) as vectors_file:
-        for line in vectors_file:
-            vector = line.strip()
-            if vector:
-                vectors.append(list(float(point) for point in vector.split(",")))
-    return vectors
+    return np.asarray(symnmfmodule.read_csv(input_data)).tolist()
 
 def parse_input():
     if len(sys.argv) == 3:
@@ -107,21 +102,12 @@ def k_means(k, d, datapoints):
 
     return convert_centroids_to_labels(datapoints, k_centroids)
 
-def init_h(n, k, W):
-    mean_w = np.mean(W)
-    constant_term = 2 * sqrt(mean_w / k)
-    H = np.random.uniform(0, high=constant_term, size=(n, k))
-    return H.tolist()
-
 def main():
     try:
         k, datapoints, n, d = parse_input()
         k_means_labels = k_means(k, d, datapoints)
         
-        W = symnmfmodule.norm(0, n, d, datapoints)
-        H = init_h(n, k, W)
-        symNMF = np.array(symnmfmodule.symnmf(k, n, W, H, 1))
-        sym_labels = symNMF.argmax(axis=1)
+        sym_labels = symnmfmodule.fit(k, n, d, datapoints, "labels", 0)
     
         print("nmf: %.4f" % silhouette_score(datapoints, sym_labels))
         print("kmeans: %.4f" % silhouette_score(datapoints, k_means_labels))
@@ -1,6 +1,7 @@
 from setuptools import Extension, setup
 
-module = Extension("symnmfmodule", sources=['symnmfmodule.c', 'symnmf.c'])
+module = Extension("symnmfmodule", sources=['symnmfmodule.c', 'symnmf.c'],
+                   extra_compile_args=['-pthread'], extra_link_args=['-pthread'])
 setup(name='symnmfmodule',
      version='1.0',
      description='Python wrapper for C extension',
@@ -4,431 +4,5345 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "symnmf.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SYMNMF_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
 #define MAX_ITER 300
 #define EPSILON 0.0001
 #define BETA 0.5
 
-double **init_matrix(int rows, int cols);
-void free_matrix_memory(double **matrix, int vec_number);
-double **calc_similarity_matrix(int vec_number, int vec_dim, double **d_points);
-double **calc_diagonal_matrix(int vec_number, int vec_dim, double **d_points);
-double **calc_normalized_similarity_matrix(int vec_number, int vec_dim, double **d_points);
-double **get_next_H_matrix(int k, int vec_number, double **norm_matrix, double **H);
-int has_converged(int k, int vec_number, double **H, double **next_h);
-double **calc_symnmf(int k, int vec_number, double **norm_matrix, double **H);
-double sum_vector_coordinates(double *v1, int vec_dim);
-double calculate_squared_euclidean_distance(double *v1, double *v2, int vec_dim);
-double **read_file(const char *file_name, int rows, int cols);
+/* Row strides are padded to a whole cache line once a row is at least that long */
+#define MATRIX_ROW_PAD (MATRIX_ALIGNMENT / (int)sizeof(double))
+
+/* GEMM blocking: MR x NR register tile, MC x KC block of op(A) (L2), KC x NC panel of op(B) (L3) */
+#define GEMM_MR 8
+#define GEMM_NR 4
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 4096
+
+/* Products smaller than this many multiply-adds are not worth waking the pool for */
+#define GEMM_PARALLEL_MIN_WORK 65536.0
+
+/* Instruction set levels of the dispatched kernels */
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+
+/* Constants of exp_block: round-to-integer shift (1.5 * 2^52), ln2 split for Cody-Waite
+ * reduction, ln(DBL_MIN), and the largest argument whose 2^n scale is still representable */
+#define EXP_LOG2E 1.4426950408889634
+#define EXP_SHIFT 6755399441055744.0
+#define EXP_LN2_HI 6.93147180369123816490e-01
+#define EXP_LN2_LO 1.90821492927058770002e-10
+#define EXP_UNDERFLOW (-708.3964185322641)
+#define EXP_OVERFLOW_GUARD 709.0
+
+/* Dimension from which the similarity matrix is built from ||x||^2 + ||y||^2 - 2 x.y with one
+ * GEMM per tile; SYMNMF_DISTANCE=gemm|direct overrides it */
+#define DISTANCE_GEMM_MIN_DIM 128
+#define DISTANCE_GEMM_BAND 512
+#define DISTANCE_GEMM_TILE 2048
+/* A GEMM distance below this fraction of ||x||^2 + ||y||^2 has lost too many digits to
+ * cancellation and is recomputed directly */
+#define DISTANCE_GEMM_RECOMPUTE 1e-6
+
+/* Columns of the pairwise distance scratch block used when a row is reduced on the fly */
+#define DISTANCE_BLOCK 256
+
+/* Independent partial sums of the convergence norm in the fused update */
+#define DELTA_LANES 4
+
+/* KD-tree leaf size, traversal stack depth, and the relative slack on the pruning radius that
+ * keeps rounding in the box distances from dropping a pair on the boundary */
+#define KD_LEAF_SIZE 16
+#define KD_MAX_DEPTH 128
+#define KD_PRUNE_SLACK 1e-9
+
+/* Layout of the out-of-core W file, and the rows a thread takes at a time from one band */
+#define DISK_MAGIC "SYMNMFW1"
+#define DISK_HEADER_BYTES 64
+#define DISK_ROW_CHUNK 16
+
+/* Nystrom: eigenvalues of the landmark block kept relative to the largest, the floor on an
+ * approximate degree, and the Jacobi sweep limit and relative off-diagonal tolerance */
+#define NYSTROM_EIGEN_CUTOFF 1e-10
+#define NYSTROM_MIN_DEGREE 1e-12
+#define JACOBI_MAX_SWEEPS 64
+#define JACOBI_TOLERANCE 1e-30
+
+/* MT19937 state length and middle word offset, for the numpy-compatible initial H */
+#define MT_STATE_SIZE 624
+#define MT_SHIFT 397
+
+/* Binary data-point files: a header of rows, cols, row stride, dtype and a data checksum,
+ * followed by the rows exactly as init_matrix lays them out */
+#define BINARY_MAGIC "SYMNMFX1"
+#define BINARY_HEADER_BYTES 64
+#define BINARY_DTYPE_FLOAT64 1
+
+/* CSV parsing: significant digits and powers of ten the exact fast path handles, the longest
+ * field copied to the stack for strtod, and the rows a chunk buffer starts with */
+#define CSV_MAX_DIGITS 19
+#define CSV_MAX_EXACT_POWER 22
+#define CSV_MAX_TOKEN 128
+#define CSV_INITIAL_ROWS 1024
+
+/* Text output: matrix entries formatted per batch, the longest "%.4f" field (sign, 309 integer
+ * digits, point and decimals, rounded up), and the magnitude below which the exact fixed-point
+ * formatter applies instead of sprintf */
+#define PRINT_BATCH_ELEMENTS (1 << 20)
+#define PRINT_MAX_FIELD 320
+#define PRINT_FAST_LIMIT 1e11
+
+/* Upper bound on pool threads, and how many row blocks each thread gets for load balancing */
+#define MAX_THREADS 256
+#define ROW_BLOCKS_PER_THREAD 8
+
+/* Row ranges handed out to pool threads on demand */
+typedef struct
+{
+    int *block_start;
+    int num_blocks;
+    int next_block;
+} RowBlocks;
+
+/* Shared state of the parallel similarity, degree and normalization loops */
+typedef struct
+{
+    const Matrix *d_points;
+    Matrix *dense;
+    PackedMatrix *packed;
+    double *sums;
+    const double *weights;
+    RowBlocks blocks;
+    const Matrix *tile;
+    int tile_row;
+    int tile_col;
+    PackedFloatMatrix *packed_float;
+} SymmetricTask;
+
+/* Shared state of the parallel stages of one SymNMF iteration */
+typedef struct
+{
+    const Matrix *H;
+    const Matrix *next_h;
+    const Matrix *WH;
+    const Matrix *denominator;
+    const PackedMatrix *packed;
+    const PackedFloatMatrix *packed_float;
+    const SparseMatrix *sparse;
+    const ImplicitAffinity *implicit;
+    const DiskAffinity *disk;
+    const LowRankAffinity *lowrank;
+    const double *band;
+    int band_first;
+    int band_last;
+    Matrix *out;
+    double *partials;
+    int num_partials;
+    int used_partials;
+    RowBlocks blocks;
+} IterationTask;
+
+/* A GEMM split by rows of C across the pool threads */
+typedef struct
+{
+    int trans_a, trans_b, m, n, k;
+    const double *a, *b;
+    double *c;
+    size_t lda, ldb, ldc;
+    int accumulate;
+    int failed;
+    double *buffers;
+    size_t buffer_size;
+    int num_buffers;
+} GemmTask;
+
+/* A KD-tree node over order[first, last); leaves have left == right == -1 */
+typedef struct
+{
+    int first, last;
+    int left, right;
+} KdNode;
+
+/* Node bounds are stored as bounds[node * 2d .. +d) = lower corner, then the upper corner */
+typedef struct
+{
+    const Matrix *d_points;
+    int *order;
+    KdNode *nodes;
+    double *bounds;
+    int num_nodes;
+} KdTree;
+
+/* One stored entry of a sparse row while the kNN graph is assembled */
+typedef struct
+{
+    int col;
+    double value;
+} SparseEntry;
+
+/* Shared state of the kNN and radius graph constructions: the directed neighbor lists
+ * (n x neighbors) or the KD-tree and squared radius, then the rows laid out one after another */
+typedef struct
+{
+    const Matrix *d_points;
+    int neighbors;
+    int *cols;
+    double *distances;
+    SparseEntry *entries;
+    size_t *entry_start;
+    size_t *row_count;
+    SparseMatrix *sparse;
+    const KdTree *tree;
+    double radius;
+    RowBlocks blocks;
+} KnnTask;
+
+/* Row-parallel pass over a sparse matrix: its row sums, or the D^-1/2 factors it is scaled by */
+typedef struct
+{
+    const SparseMatrix *matrix;
+    double *scale;
+    RowBlocks blocks;
+} SparseRowsTask;
+
+/* Everything one SymNMF solve needs besides W and the caller's H; see init_symnmf_workspace */
+typedef struct
+{
+    Matrix *buffer;
+    Matrix *WH;
+    Matrix *gram;
+    Matrix *denominator;
+    double *partials;
+    int num_partials;
+    int disk_partials;
+    double *gemm_buffers;
+    size_t gemm_buffer_size;
+    double *disk_buffers;
+    Matrix *lowrank_temp;
+    RowBlocks triangle_blocks;
+} SymnmfWorkspace;
+
+/* Shared state of writing one band of the out-of-core W */
+typedef struct
+{
+    const Matrix *d_points;
+    const double *inv_sqrt;
+    double *band;
+    int first_row;
+    int last_row;
+    double *sums;
+} DiskTask;
+
+/* The two band slots shared by the multiply and the read-ahead thread */
+typedef struct
+{
+    const DiskAffinity *disk;
+    double *buffers[2];
+    int filled[2];
+    int stop;
+    int failed;
+    double io_seconds;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} DiskStream;
+
+/* Shared state of the parallel CSV reader: per-chunk row buffers and their row offsets */
+typedef struct
+{
+    const char *text;
+    size_t length;
+    int cols;
+    int num_chunks;
+    int failed;
+    double *values[MAX_THREADS];
+    int rows[MAX_THREADS];
+    int row_start[MAX_THREADS + 1];
+    Matrix *matrix;
+} CsvTask;
+
+/* State of the MT19937 generator behind init_symnmf_h */
+typedef struct
+{
+    uint32_t state[MT_STATE_SIZE];
+    int next;
+} MersenneTwister;
+
+/* Running state of the binary file checksum */
+typedef struct
+{
+    uint64_t lanes[4];
+    size_t count;
+} BinaryChecksum;
+
+/* A matrix being printed, from whichever storage holds it, and the per-thread text of the
+ * current batch of rows */
+typedef struct
+{
+    const Matrix *dense;
+    const PackedMatrix *packed;
+    const PackedFloatMatrix *packed_float;
+    const double *diagonal;
+    int rows;
+    int cols;
+    int first_row;
+    int last_row;
+    int num_chunks;
+    int failed;
+    char *text[MAX_THREADS];
+    size_t length[MAX_THREADS];
+    size_t capacity[MAX_THREADS];
+} PrintTask;
+
+Matrix *init_matrix(int rows, int cols);
+Matrix *wrap_matrix(double *data, int rows, int cols, int stride, void (*release)(void *owner), void *owner);
+void free_matrix_memory(Matrix *matrix);
+PackedMatrix *init_packed_matrix(int size);
+void free_packed_matrix(PackedMatrix *matrix);
+PackedFloatMatrix *init_packed_float_matrix(int size);
+void free_packed_float_matrix(PackedFloatMatrix *matrix);
+SparseMatrix *init_sparse_matrix(int size, size_t nnz);
+void free_sparse_matrix(SparseMatrix *matrix);
+const char *get_distance_kernel(void);
+double squared_euclidean_distance(const double *v1, const double *v2, int vec_dim);
+void squared_distances_to_points(const double *point, const Matrix *points, int first, int last, double *out);
+int get_exp_mode(void);
+int set_exp_mode(int mode);
+void exp_block(double *values, int count);
+void gaussian_affinity_block(double *values, int count);
+int get_precision(void);
+void set_precision(int mode);
+void set_num_threads(int num_threads);
+int get_num_threads(void);
+void parallel_run(ParallelTask task, void *arg);
+Matrix *calc_similarity_matrix(const Matrix *d_points);
+PackedMatrix *calc_packed_similarity_matrix(const Matrix *d_points);
+double *calc_row_sums(const Matrix *matrix);
+double *calc_packed_row_sums(const PackedMatrix *matrix);
+double *calc_degree_vector(const Matrix *d_points);
+Matrix *calc_diagonal_matrix(const Matrix *d_points);
+PackedMatrix *calc_packed_diagonal_matrix(const Matrix *d_points);
+int normalize_similarity_matrix(Matrix *A, const double *degrees);
+Matrix *calc_normalized_similarity_matrix(const Matrix *d_points);
+int normalize_packed_similarity_matrix(PackedMatrix *A, const double *degrees);
+PackedMatrix *calc_packed_normalized_similarity_matrix(const Matrix *d_points);
+PackedFloatMatrix *calc_packed_float_normalized_similarity_matrix(const Matrix *d_points);
+SparseMatrix *calc_knn_similarity_matrix(const Matrix *d_points, int neighbors);
+double *calc_sparse_row_sums(const SparseMatrix *matrix);
+int normalize_sparse_similarity_matrix(SparseMatrix *A, const double *degrees);
+SparseMatrix *calc_knn_normalized_similarity_matrix(const Matrix *d_points, int neighbors);
+SparseMatrix *calc_radius_similarity_matrix(const Matrix *d_points, double tolerance);
+SparseMatrix *calc_radius_normalized_similarity_matrix(const Matrix *d_points, double tolerance);
+ImplicitAffinity *init_implicit_affinity(const Matrix *d_points);
+void free_implicit_affinity(ImplicitAffinity *affinity);
+DiskAffinity *write_disk_affinity(const Matrix *d_points, const char *path, size_t memory_budget);
+void free_disk_affinity(DiskAffinity *disk);
+LowRankAffinity *calc_nystrom_affinity(const Matrix *d_points, int landmarks, int method, unsigned long seed);
+double nystrom_sample_error(const LowRankAffinity *affinity, const Matrix *d_points, int samples, unsigned long seed,
+                            double *max_error);
+double lowrank_affinity_mean(const LowRankAffinity *affinity);
+void free_lowrank_affinity(LowRankAffinity *affinity);
+Matrix *calc_gram_matrix(const Matrix *H);
+int affinity_times_matrix(const Affinity *W, const Matrix *H, Matrix *WH);
+Matrix *get_next_H_matrix(const Affinity *W, const Matrix *H);
+int has_converged(const Matrix *H, const Matrix *next_h);
+Matrix *calc_symnmf_affinity(const Affinity *W, Matrix *H);
+Matrix *calc_symnmf(const Matrix *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_packed(const PackedMatrix *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_sparse(const SparseMatrix *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_implicit(const ImplicitAffinity *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_disk(const DiskAffinity *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_lowrank(const LowRankAffinity *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_packed_float(const PackedFloatMatrix *norm_matrix, Matrix *H);
+void scale_initial_h(Matrix *H, double mean, int k);
+Matrix *init_symnmf_h(int n, int k, double mean_w, unsigned long seed);
+Matrix *fit_symnmf(const Matrix *d_points, int k, unsigned long seed);
+void calc_labels(const Matrix *H, int *labels);
+double sum_vector_coordinates(const double *v1, int vec_dim);
+double calculate_squared_euclidean_distance(const double *v1, const double *v2, int vec_dim);
+Matrix *parse_csv_file(const char *file_name);
+Matrix *read_file(const char *file_name, int rows, int cols);
 void calc_matrix_dim(char *file_name, int *dim);
-double **matrix_multiplication(double **matrix1, double **matrix2, int rows1, int cols1, int cols2);
-double **calc_matrix_transpose(double **matrix, int vec_number, int vec_dim);
-double **calc_matrix_by_goal(char *goal, double **d_points, int vec_number, int vec_dim);
-void make_a_copy(double **dest, double **src, int rows, int cols);
-void print_matrix(double **d_points, int vec_number, int vec_dim);
+int is_binary_matrix_file(const char *file_name);
+int write_binary_matrix(const Matrix *matrix, const char *file_name);
+Matrix *map_binary_matrix(const char *file_name, int verify);
+int convert_to_binary(const char *csv_name, const char *binary_name);
+int gemm(int trans_a, int trans_b, const Matrix *A, const Matrix *B, Matrix *C, int accumulate);
+static size_t gemm_buffer_size(int n);
+static int gemm_buffered(int trans_a, int trans_b, const Matrix *A, const Matrix *B, Matrix *C, int accumulate,
+                         double *buffers, size_t buffer_size, int num_buffers);
+Matrix *matrix_multiplication(const Matrix *matrix1, const Matrix *matrix2);
+Matrix *matrix_multiplication_tn(const Matrix *matrix1, const Matrix *matrix2);
+Matrix *matrix_multiplication_nt(const Matrix *matrix1, const Matrix *matrix2);
+PackedMatrix *calc_matrix_by_goal(char *goal, const Matrix *d_points);
+void make_a_copy(Matrix *dest, const Matrix *src);
+const char *get_output_file(void);
+int set_output_file(const char *file_name);
+int print_matrix(const Matrix *matrix);
+int print_packed_matrix(const PackedMatrix *matrix);
+int print_packed_float_matrix(const PackedFloatMatrix *matrix);
+int print_diagonal_matrix(const double *diagonal, int size);
 
 /* Functions */
 
-double **init_matrix(int rows, int cols)
+Matrix *init_matrix(int rows, int cols)
+{
+    Matrix *matrix;
+    size_t stride, bytes;
+    void *data = NULL;
+
+    if (rows < 0 || cols < 0)
+    {
+        return NULL;
+    }
+    stride = (size_t)cols;
+    if (cols >= MATRIX_ROW_PAD)
+    {
+        stride = (stride + MATRIX_ROW_PAD - 1) / MATRIX_ROW_PAD * MATRIX_ROW_PAD;
+    }
+    if (stride != 0 && (size_t)rows > ((size_t)-1 / sizeof(double)) / stride)
+    {
+        return NULL;
+    }
+    bytes = (size_t)rows * stride * sizeof(double);
+
+    if ((matrix = (Matrix *)malloc(sizeof(Matrix))) == NULL)
+    {
+        return NULL;
+    }
+    if (posix_memalign(&data, MATRIX_ALIGNMENT, bytes ? bytes : MATRIX_ALIGNMENT) != 0)
+    {
+        free(matrix);
+        return NULL;
+    }
+    memset(data, 0, bytes);
+
+    matrix->data = (double *)data;
+    matrix->rows = rows;
+    matrix->cols = cols;
+    matrix->stride = (int)stride;
+    matrix->mapping = NULL;
+    matrix->mapping_bytes = 0;
+    matrix->release = NULL;
+    matrix->owner = NULL;
+    return matrix;
+}
+
+/* A Matrix over storage owned by someone else; release(owner) is called in place of freeing it */
+Matrix *wrap_matrix(double *data, int rows, int cols, int stride, void (*release)(void *owner), void *owner)
+{
+    Matrix *matrix;
+    if (rows < 0 || cols < 0 || stride < cols || release == NULL || (matrix = (Matrix *)malloc(sizeof(Matrix))) == NULL)
+    {
+        return NULL;
+    }
+    matrix->data = data;
+    matrix->rows = rows;
+    matrix->cols = cols;
+    matrix->stride = stride;
+    matrix->mapping = NULL;
+    matrix->mapping_bytes = 0;
+    matrix->release = release;
+    matrix->owner = owner;
+    return matrix;
+}
+
+void free_matrix_memory(Matrix *matrix)
+{
+    if (!matrix)
+    {
+        return;
+    }
+    if (matrix->mapping)
+    {
+        munmap(matrix->mapping, matrix->mapping_bytes);
+    }
+    else if (matrix->release)
+    {
+        matrix->release(matrix->owner);
+    }
+    else
+    {
+        free(matrix->data);
+    }
+    free(matrix);
+}
+
+PackedMatrix *init_packed_matrix(int size)
+{
+    PackedMatrix *matrix;
+    size_t entries, bytes;
+    void *data = NULL;
+
+    if (size < 0)
+    {
+        return NULL;
+    }
+    entries = (size_t)size * ((size_t)size + 1) / 2;
+    if (entries > (size_t)-1 / sizeof(double))
+    {
+        return NULL;
+    }
+    bytes = entries * sizeof(double);
+
+    if ((matrix = (PackedMatrix *)malloc(sizeof(PackedMatrix))) == NULL)
+    {
+        return NULL;
+    }
+    if (posix_memalign(&data, MATRIX_ALIGNMENT, bytes ? bytes : MATRIX_ALIGNMENT) != 0)
+    {
+        free(matrix);
+        return NULL;
+    }
+    memset(data, 0, bytes);
+
+    matrix->data = (double *)data;
+    matrix->size = size;
+    return matrix;
+}
+
+void free_packed_matrix(PackedMatrix *matrix)
+{
+    if (!matrix)
+    {
+        return;
+    }
+    free(matrix->data);
+    free(matrix);
+}
+
+PackedFloatMatrix *init_packed_float_matrix(int size)
+{
+    PackedFloatMatrix *matrix;
+    size_t entries, bytes;
+    void *data = NULL;
+
+    if (size < 0)
+    {
+        return NULL;
+    }
+    entries = (size_t)size * ((size_t)size + 1) / 2;
+    if (entries > (size_t)-1 / sizeof(float))
+    {
+        return NULL;
+    }
+    bytes = entries * sizeof(float);
+
+    if ((matrix = (PackedFloatMatrix *)malloc(sizeof(PackedFloatMatrix))) == NULL)
+    {
+        return NULL;
+    }
+    if (posix_memalign(&data, MATRIX_ALIGNMENT, bytes ? bytes : MATRIX_ALIGNMENT) != 0)
+    {
+        free(matrix);
+        return NULL;
+    }
+    memset(data, 0, bytes);
+
+    matrix->data = (float *)data;
+    matrix->size = size;
+    return matrix;
+}
+
+void free_packed_float_matrix(PackedFloatMatrix *matrix)
+{
+    if (!matrix)
+    {
+        return;
+    }
+    free(matrix->data);
+    free(matrix);
+}
+
+SparseMatrix *init_sparse_matrix(int size, size_t nnz)
+{
+    SparseMatrix *matrix = (SparseMatrix *)malloc(sizeof(SparseMatrix));
+    if (!matrix)
+    {
+        return NULL;
+    }
+    matrix->size = size;
+    matrix->row_start = (size_t *)calloc((size_t)size + 1, sizeof(size_t));
+    matrix->cols = (int *)malloc((nnz ? nnz : 1) * sizeof(int));
+    matrix->values = (double *)malloc((nnz ? nnz : 1) * sizeof(double));
+    if (!matrix->row_start || !matrix->cols || !matrix->values)
+    {
+        free_sparse_matrix(matrix);
+        return NULL;
+    }
+    return matrix;
+}
+
+void free_sparse_matrix(SparseMatrix *matrix)
+{
+    if (!matrix)
+    {
+        return;
+    }
+    free(matrix->row_start);
+    free(matrix->cols);
+    free(matrix->values);
+    free(matrix);
+}
+
+/* Squared Euclidean distance kernels. One implementation per instruction set is compiled with a
+ * function-level target attribute, and the widest one the CPU supports is picked on first use. */
+
+static double squared_distance_scalar(const double *v1, const double *v2, int dim)
+{
+    int i;
+    double sum = 0.0;
+    for (i = 0; i < dim; i++)
+    {
+        double diff = v1[i] - v2[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+static void squared_distance_many_scalar(const double *point, const double *points, size_t stride,
+                                         int count, int dim, double *out)
+{
+    int j;
+    for (j = 0; j < count; j++)
+    {
+        out[j] = squared_distance_scalar(point, points + (size_t)j * stride, dim);
+    }
+}
+
+#ifdef SYMNMF_X86_DISPATCH
+
+/* A sign-bit mask for the first r lanes of a 4-lane AVX load starts at DISTANCE_MASK + 4 - r */
+static const double DISTANCE_MASK[8] = {-1.0, -1.0, -1.0, -1.0, 0.0, 0.0, 0.0, 0.0};
+
+__attribute__((target("sse2"))) static double squared_distance_sse2(const double *v1, const double *v2, int dim)
+{
+    int i;
+    double lanes[2], sum;
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    for (i = 0; i + 4 <= dim; i += 4)
+    {
+        __m128d d0 = _mm_sub_pd(_mm_loadu_pd(v1 + i), _mm_loadu_pd(v2 + i));
+        __m128d d1 = _mm_sub_pd(_mm_loadu_pd(v1 + i + 2), _mm_loadu_pd(v2 + i + 2));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+    }
+    if (i + 2 <= dim)
+    {
+        __m128d d0 = _mm_sub_pd(_mm_loadu_pd(v1 + i), _mm_loadu_pd(v2 + i));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+        i += 2;
+    }
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    sum = lanes[0] + lanes[1];
+    if (i < dim)
+    {
+        double diff = v1[i] - v2[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+/* Up to 8 coordinates of the query point stay in registers across the whole block */
+__attribute__((target("sse2"))) static void squared_distance_many_sse2(const double *point, const double *points,
+                                                                      size_t stride, int count, int dim, double *out)
+{
+    int j, c, chunks = dim / 2;
+    __m128d q[4];
+    if (dim > 8)
+    {
+        for (j = 0; j < count; j++)
+        {
+            out[j] = squared_distance_sse2(point, points + (size_t)j * stride, dim);
+        }
+        return;
+    }
+    for (c = 0; c < chunks; c++)
+    {
+        q[c] = _mm_loadu_pd(point + 2 * c);
+    }
+    for (j = 0; j < count; j++)
+    {
+        const double *other = points + (size_t)j * stride;
+        __m128d acc = _mm_setzero_pd();
+        double lanes[2], sum;
+        for (c = 0; c < chunks; c++)
+        {
+            __m128d d = _mm_sub_pd(q[c], _mm_loadu_pd(other + 2 * c));
+            acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+        }
+        _mm_storeu_pd(lanes, acc);
+        sum = lanes[0] + lanes[1];
+        if (dim & 1)
+        {
+            double diff = point[dim - 1] - other[dim - 1];
+            sum += diff * diff;
+        }
+        out[j] = sum;
+    }
+}
+
+__attribute__((target("avx2,fma"))) static double horizontal_sum_avx2(__m256d v)
+{
+    __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+__attribute__((target("avx2,fma"))) static double squared_distance_avx2(const double *v1, const double *v2, int dim)
+{
+    int i;
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    for (i = 0; i + 8 <= dim; i += 8)
+    {
+        __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(v1 + i), _mm256_loadu_pd(v2 + i));
+        __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(v1 + i + 4), _mm256_loadu_pd(v2 + i + 4));
+        acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+        acc1 = _mm256_fmadd_pd(d1, d1, acc1);
+    }
+    for (; i < dim; i += 4)
+    {
+        int rest = dim - i < 4 ? dim - i : 4;
+        __m256i mask = _mm256_castpd_si256(_mm256_loadu_pd(DISTANCE_MASK + 4 - rest));
+        __m256d d = _mm256_sub_pd(_mm256_maskload_pd(v1 + i, mask), _mm256_maskload_pd(v2 + i, mask));
+        acc0 = _mm256_fmadd_pd(d, d, acc0);
+    }
+    return horizontal_sum_avx2(_mm256_add_pd(acc0, acc1));
+}
+
+/* Up to 16 coordinates of the query point stay in registers across the whole block */
+__attribute__((target("avx2,fma"))) static void squared_distance_many_avx2(const double *point, const double *points,
+                                                                          size_t stride, int count, int dim, double *out)
+{
+    int j, c, chunks = (dim + 3) / 4;
+    __m256i tail;
+    __m256d q[4];
+    if (dim > 16 || dim == 0)
+    {
+        for (j = 0; j < count; j++)
+        {
+            out[j] = squared_distance_avx2(point, points + (size_t)j * stride, dim);
+        }
+        return;
+    }
+    tail = _mm256_castpd_si256(_mm256_loadu_pd(DISTANCE_MASK + 4 - (dim - 4 * (chunks - 1))));
+    for (c = 0; c < chunks - 1; c++)
+    {
+        q[c] = _mm256_loadu_pd(point + 4 * c);
+    }
+    q[chunks - 1] = _mm256_maskload_pd(point + 4 * (chunks - 1), tail);
+    for (j = 0; j < count; j++)
+    {
+        const double *other = points + (size_t)j * stride;
+        __m256d acc = _mm256_setzero_pd();
+        __m256d d;
+        for (c = 0; c < chunks - 1; c++)
+        {
+            d = _mm256_sub_pd(q[c], _mm256_loadu_pd(other + 4 * c));
+            acc = _mm256_fmadd_pd(d, d, acc);
+        }
+        d = _mm256_sub_pd(q[chunks - 1], _mm256_maskload_pd(other + 4 * (chunks - 1), tail));
+        acc = _mm256_fmadd_pd(d, d, acc);
+        out[j] = horizontal_sum_avx2(acc);
+    }
+}
+
+__attribute__((target("avx512f"))) static double squared_distance_avx512(const double *v1, const double *v2, int dim)
+{
+    int i;
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    for (i = 0; i + 16 <= dim; i += 16)
+    {
+        __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(v1 + i), _mm512_loadu_pd(v2 + i));
+        __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(v1 + i + 8), _mm512_loadu_pd(v2 + i + 8));
+        acc0 = _mm512_fmadd_pd(d0, d0, acc0);
+        acc1 = _mm512_fmadd_pd(d1, d1, acc1);
+    }
+    for (; i < dim; i += 8)
+    {
+        __mmask8 mask = (__mmask8)(dim - i < 8 ? (1u << (dim - i)) - 1 : 0xFFu);
+        __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, v1 + i), _mm512_maskz_loadu_pd(mask, v2 + i));
+        acc0 = _mm512_fmadd_pd(d, d, acc0);
+    }
+    return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+/* Up to 16 coordinates of the query point stay in registers across the whole block */
+__attribute__((target("avx512f"))) static void squared_distance_many_avx512(const double *point, const double *points,
+                                                                            size_t stride, int count, int dim, double *out)
+{
+    int j;
+    __mmask8 low, high;
+    __m512d q0, q1;
+    if (dim > 16 || dim == 0)
+    {
+        for (j = 0; j < count; j++)
+        {
+            out[j] = squared_distance_avx512(point, points + (size_t)j * stride, dim);
+        }
+        return;
+    }
+    low = (__mmask8)(dim < 8 ? (1u << dim) - 1 : 0xFFu);
+    high = (__mmask8)(dim > 8 ? (1u << (dim - 8)) - 1 : 0u);
+    q0 = _mm512_maskz_loadu_pd(low, point);
+    q1 = _mm512_maskz_loadu_pd(high, point + 8);
+    for (j = 0; j < count; j++)
+    {
+        const double *other = points + (size_t)j * stride;
+        __m512d d0 = _mm512_sub_pd(q0, _mm512_maskz_loadu_pd(low, other));
+        __m512d acc = _mm512_mul_pd(d0, d0);
+        if (high)
+        {
+            __m512d d1 = _mm512_sub_pd(q1, _mm512_maskz_loadu_pd(high, other + 8));
+            acc = _mm512_fmadd_pd(d1, d1, acc);
+        }
+        out[j] = _mm512_reduce_add_pd(acc);
+    }
+}
+
+#endif
+
+static double (*squared_distance_kernel)(const double *, const double *, int) = squared_distance_scalar;
+static void (*squared_distance_many_kernel)(const double *, const double *, size_t, int, int, double *) =
+    squared_distance_many_scalar;
+static const char *distance_kernel_name = "scalar";
+static int simd_level = SIMD_SCALAR;
+static pthread_once_t distance_kernel_once = PTHREAD_ONCE_INIT;
+
+/* SYMNMF_SIMD=scalar|sse2|avx2|avx512 caps the instruction set, e.g. to compare against scalar */
+static void select_distance_kernel(void)
+{
+#ifdef SYMNMF_X86_DISPATCH
+    const char *cap = getenv("SYMNMF_SIMD");
+    int level = SIMD_AVX512;
+    if (cap != NULL)
+    {
+        level = !strcmp(cap, "scalar") ? SIMD_SCALAR : !strcmp(cap, "sse2") ? SIMD_SSE2 : !strcmp(cap, "avx2") ? SIMD_AVX2 : SIMD_AVX512;
+    }
+    __builtin_cpu_init();
+    if (level >= SIMD_AVX512 && __builtin_cpu_supports("avx512f"))
+    {
+        squared_distance_kernel = squared_distance_avx512;
+        squared_distance_many_kernel = squared_distance_many_avx512;
+        distance_kernel_name = "avx512";
+        simd_level = SIMD_AVX512;
+    }
+    else if (level >= SIMD_AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        squared_distance_kernel = squared_distance_avx2;
+        squared_distance_many_kernel = squared_distance_many_avx2;
+        distance_kernel_name = "avx2";
+        simd_level = SIMD_AVX2;
+    }
+    else if (level >= SIMD_SSE2 && __builtin_cpu_supports("sse2"))
+    {
+        squared_distance_kernel = squared_distance_sse2;
+        squared_distance_many_kernel = squared_distance_many_sse2;
+        distance_kernel_name = "sse2";
+        simd_level = SIMD_SSE2;
+    }
+#endif
+}
+
+static int get_simd_level(void)
+{
+    pthread_once(&distance_kernel_once, select_distance_kernel);
+    return simd_level;
+}
+
+const char *get_distance_kernel(void)
+{
+    pthread_once(&distance_kernel_once, select_distance_kernel);
+    return distance_kernel_name;
+}
+
+double squared_euclidean_distance(const double *v1, const double *v2, int vec_dim)
+{
+    pthread_once(&distance_kernel_once, select_distance_kernel);
+    return squared_distance_kernel(v1, v2, vec_dim);
+}
+
+/* out[j - first] = ||point - points_j||^2 for every j in [first, last) */
+void squared_distances_to_points(const double *point, const Matrix *points, int first, int last, double *out)
+{
+    pthread_once(&distance_kernel_once, select_distance_kernel);
+    if (last > first)
+    {
+        squared_distance_many_kernel(point, MATRIX_ROW(points, first), points->stride, last - first, points->cols, out);
+    }
+}
+
+/* Block exponential for the Gaussian affinity. x = n*ln2 + r with |r| <= ln2/2 (Cody-Waite
+ * reduction), e^r from a Taylor polynomial and 2^n assembled directly in the exponent bits.
+ *  - EXP_STRICT: degree 13, within 1 ulp of libm exp.
+ *  - EXP_FAST: degree 7, relative error below 1e-8.
+ * Arguments below ln(DBL_MIN), whose results would be denormal, give exactly 0. */
+
+typedef union
+{
+    double value;
+    uint64_t bits;
+} DoubleBits;
+
+static int exp_mode = -1;
+static int precision_mode = -1;
+
+static void exp_block_strict_body(double *values, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        double x = values[i];
+        double n, r, tail;
+        DoubleBits shifted, scale;
+        shifted.value = x * EXP_LOG2E + EXP_SHIFT;
+        n = shifted.value - EXP_SHIFT;
+        r = (x - n * EXP_LN2_HI) - n * EXP_LN2_LO;
+        tail = 1.0 / 6227020800.0;
+        tail = 1.0 / 479001600.0 + r * tail;
+        tail = 1.0 / 39916800.0 + r * tail;
+        tail = 1.0 / 3628800.0 + r * tail;
+        tail = 1.0 / 362880.0 + r * tail;
+        tail = 1.0 / 40320.0 + r * tail;
+        tail = 1.0 / 5040.0 + r * tail;
+        tail = 1.0 / 720.0 + r * tail;
+        tail = 1.0 / 120.0 + r * tail;
+        tail = 1.0 / 24.0 + r * tail;
+        tail = 1.0 / 6.0 + r * tail;
+        tail = 0.5 + r * tail;
+        scale.bits = (shifted.bits + 1023) << 52;
+        values[i] = (x < EXP_UNDERFLOW) ? 0.0 : (1.0 + (r + r * r * tail)) * scale.value;
+    }
+}
+
+static void exp_block_fast_body(double *values, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        double x = values[i];
+        double n, r, p;
+        DoubleBits shifted, scale;
+        shifted.value = x * EXP_LOG2E + EXP_SHIFT;
+        n = shifted.value - EXP_SHIFT;
+        r = (x - n * EXP_LN2_HI) - n * EXP_LN2_LO;
+        p = 1.0 / 5040.0;
+        p = 1.0 / 720.0 + r * p;
+        p = 1.0 / 120.0 + r * p;
+        p = 1.0 / 24.0 + r * p;
+        p = 1.0 / 6.0 + r * p;
+        p = 0.5 + r * p;
+        p = 1.0 + r * p;
+        p = 1.0 + r * p;
+        scale.bits = (shifted.bits + 1023) << 52;
+        values[i] = (x < EXP_UNDERFLOW) ? 0.0 : p * scale.value;
+    }
+}
+
+#ifdef SYMNMF_X86_DISPATCH
+/* Four lanes of the reduction above: returns 2^n and sets r. Plain multiplies and adds, no FMA,
+ * so every lane rounds exactly as the scalar bodies do. */
+__attribute__((target("avx2"))) static __m256d exp_reduce_avx2(__m256d x, __m256d *r)
+{
+    __m256d shift = _mm256_set1_pd(EXP_SHIFT);
+    __m256d shifted = _mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(EXP_LOG2E)), shift);
+    __m256d n = _mm256_sub_pd(shifted, shift);
+    __m256i bits = _mm256_add_epi64(_mm256_castpd_si256(shifted), _mm256_set1_epi64x(1023));
+    *r = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(EXP_LN2_HI))),
+                       _mm256_mul_pd(n, _mm256_set1_pd(EXP_LN2_LO)));
+    return _mm256_castsi256_pd(_mm256_slli_epi64(bits, 52));
+}
+
+/* One Horner step: c + r * p */
+#define EXP_HORNER_AVX2(c, r, p) _mm256_add_pd(_mm256_set1_pd(c), _mm256_mul_pd((r), (p)))
+
+__attribute__((target("avx2"))) static void exp_block_strict_avx2(double *values, int count)
+{
+    int i;
+    __m256d underflow = _mm256_set1_pd(EXP_UNDERFLOW);
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(values + i);
+        __m256d r, tail, result;
+        __m256d scale = exp_reduce_avx2(x, &r);
+        tail = _mm256_set1_pd(1.0 / 6227020800.0);
+        tail = EXP_HORNER_AVX2(1.0 / 479001600.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 39916800.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 3628800.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 362880.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 40320.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 5040.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 720.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 120.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 24.0, r, tail);
+        tail = EXP_HORNER_AVX2(1.0 / 6.0, r, tail);
+        tail = EXP_HORNER_AVX2(0.5, r, tail);
+        result = _mm256_add_pd(r, _mm256_mul_pd(_mm256_mul_pd(r, r), tail));
+        result = _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd(1.0), result), scale);
+        _mm256_storeu_pd(values + i, _mm256_andnot_pd(_mm256_cmp_pd(x, underflow, _CMP_LT_OQ), result));
+    }
+    exp_block_strict_body(values + i, count - i);
+}
+
+__attribute__((target("avx2"))) static void exp_block_fast_avx2(double *values, int count)
+{
+    int i;
+    __m256d underflow = _mm256_set1_pd(EXP_UNDERFLOW);
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(values + i);
+        __m256d r, p;
+        __m256d scale = exp_reduce_avx2(x, &r);
+        p = _mm256_set1_pd(1.0 / 5040.0);
+        p = EXP_HORNER_AVX2(1.0 / 720.0, r, p);
+        p = EXP_HORNER_AVX2(1.0 / 120.0, r, p);
+        p = EXP_HORNER_AVX2(1.0 / 24.0, r, p);
+        p = EXP_HORNER_AVX2(1.0 / 6.0, r, p);
+        p = EXP_HORNER_AVX2(0.5, r, p);
+        p = EXP_HORNER_AVX2(1.0, r, p);
+        p = EXP_HORNER_AVX2(1.0, r, p);
+        p = _mm256_mul_pd(p, scale);
+        _mm256_storeu_pd(values + i, _mm256_andnot_pd(_mm256_cmp_pd(x, underflow, _CMP_LT_OQ), p));
+    }
+    exp_block_fast_body(values + i, count - i);
+}
+#endif
+
+/* SYMNMF_EXP=fast picks the fast mode until set_exp_mode is called */
+int get_exp_mode(void)
+{
+    if (exp_mode < 0)
+    {
+        const char *env = getenv("SYMNMF_EXP");
+        exp_mode = (env != NULL && !strcmp(env, "fast")) ? EXP_FAST : EXP_STRICT;
+    }
+    return exp_mode;
+}
+
+/* 0 on success, 1 (mode unchanged) for anything but EXP_STRICT or EXP_FAST */
+int set_exp_mode(int mode)
+{
+    if (mode != EXP_STRICT && mode != EXP_FAST)
+    {
+        return 1;
+    }
+    exp_mode = mode;
+    return 0;
+}
+
+/* SYMNMF_PRECISION=mixed (or float) stores W in float until set_precision is called */
+int get_precision(void)
+{
+    if (precision_mode < 0)
+    {
+        const char *env = getenv("SYMNMF_PRECISION");
+        int mixed = env != NULL && (!strcmp(env, "mixed") || !strcmp(env, "float"));
+        precision_mode = mixed ? PRECISION_MIXED : PRECISION_DOUBLE;
+    }
+    return precision_mode;
+}
+
+void set_precision(int mode)
+{
+    precision_mode = (mode == PRECISION_MIXED) ? PRECISION_MIXED : PRECISION_DOUBLE;
+}
+
+/* values[i] = exp(values[i]); arguments above EXP_OVERFLOW_GUARD are left to libm */
+void exp_block(double *values, int count)
+{
+    int i, overflow = 0, fast = get_exp_mode() == EXP_FAST;
+    for (i = 0; i < count; i++)
+    {
+        overflow |= values[i] > EXP_OVERFLOW_GUARD;
+    }
+    if (overflow)
+    {
+        for (i = 0; i < count; i++)
+        {
+            values[i] = exp(values[i]);
+        }
+        return;
+    }
+#ifdef SYMNMF_X86_DISPATCH
+    if (get_simd_level() >= SIMD_AVX2)
+    {
+        if (fast)
+        {
+            exp_block_fast_avx2(values, count);
+        }
+        else
+        {
+            exp_block_strict_avx2(values, count);
+        }
+        return;
+    }
+#endif
+    if (fast)
+    {
+        exp_block_fast_body(values, count);
+    }
+    else
+    {
+        exp_block_strict_body(values, count);
+    }
+}
+
+/* Turns squared distances into Gaussian affinities exp(-d/2) in place */
+void gaussian_affinity_block(double *values, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        values[i] = (-0.5) * values[i];
+    }
+    exp_block(values, count);
+}
+
+/* Thread pool: a fixed set of workers that lives for the whole process. parallel_run hands the
+ * same task to every worker and to the calling thread, then waits for all of them to finish. */
+
+static pthread_mutex_t pool_dispatch = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_workers[MAX_THREADS];
+static int pool_size = 0;
+static int pool_requested = 0;
+static int pool_pending = 0;
+static int pool_shutdown = 0;
+static unsigned long pool_generation = 0;
+static unsigned long pool_first_generation = 0;
+static ParallelTask pool_task = NULL;
+static void *pool_arg = NULL;
+
+static int default_num_threads(void)
+{
+    const char *env = getenv("SYMNMF_NUM_THREADS");
+    long threads = env ? strtol(env, NULL, 10) : 0;
+    if (threads <= 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    return threads > MAX_THREADS ? MAX_THREADS : (int)threads;
+}
+
+static void *pool_worker(void *data)
+{
+    int thread_id = (int)(size_t)data;
+    unsigned long seen;
+    ParallelTask task;
+    void *arg;
+    int num_threads;
+
+    pthread_mutex_lock(&pool_lock);
+    seen = pool_first_generation;
+    for (;;)
+    {
+        while (pool_generation == seen && !pool_shutdown)
+        {
+            pthread_cond_wait(&pool_start, &pool_lock);
+        }
+        if (pool_shutdown)
+        {
+            break;
+        }
+        seen = pool_generation;
+        task = pool_task;
+        arg = pool_arg;
+        num_threads = pool_size;
+        pthread_mutex_unlock(&pool_lock);
+
+        task(arg, thread_id, num_threads);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_pending == 0)
+        {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+/* Both helpers expect pool_dispatch to be held by the caller */
+static void pool_start_workers(int threads)
+{
+    int i;
+    pool_size = 1;
+    pool_first_generation = pool_generation;
+    for (i = 1; i < threads; i++)
+    {
+        if (pthread_create(&pool_workers[i], NULL, pool_worker, (void *)(size_t)i) != 0)
+        {
+            break;
+        }
+        pool_size++;
+    }
+}
+
+static void pool_stop_workers(void)
+{
+    int i;
+    pthread_mutex_lock(&pool_lock);
+    pool_shutdown = 1;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 1; i < pool_size; i++)
+    {
+        pthread_join(pool_workers[i], NULL);
+    }
+    pool_shutdown = 0;
+    pool_size = 0;
+}
+
+void set_num_threads(int num_threads)
+{
+    pthread_mutex_lock(&pool_dispatch);
+    if (pool_size != 0)
+    {
+        pool_stop_workers();
+    }
+    pool_requested = num_threads > MAX_THREADS ? MAX_THREADS : num_threads;
+    pthread_mutex_unlock(&pool_dispatch);
+}
+
+int get_num_threads(void)
+{
+    int threads;
+    pthread_mutex_lock(&pool_dispatch);
+    threads = pool_size ? pool_size : (pool_requested > 0 ? pool_requested : default_num_threads());
+    pthread_mutex_unlock(&pool_dispatch);
+    return threads;
+}
+
+/* When the pool is already busy (another caller, or a nested call) the task runs inline on one thread */
+void parallel_run(ParallelTask task, void *arg)
+{
+    int threads;
+    if (pthread_mutex_trylock(&pool_dispatch) != 0)
+    {
+        task(arg, 0, 1);
+        return;
+    }
+    if (pool_size == 0)
+    {
+        pool_start_workers(pool_requested > 0 ? pool_requested : default_num_threads());
+    }
+    threads = pool_size;
+
+    if (threads > 1)
+    {
+        pthread_mutex_lock(&pool_lock);
+        pool_task = task;
+        pool_arg = arg;
+        pool_pending = threads - 1;
+        pool_generation++;
+        pthread_cond_broadcast(&pool_start);
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    task(arg, 0, threads);
+
+    if (threads > 1)
+    {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_pending > 0)
+        {
+            pthread_cond_wait(&pool_done, &pool_lock);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    pthread_mutex_unlock(&pool_dispatch);
+}
+
+/* Splits rows [0, rows) into blocks of about equal work for the pool threads to claim one at a
+ * time. In a triangular loop row i costs rows - i, otherwise every row costs the same. */
+static int init_row_blocks(RowBlocks *blocks, int rows, int triangular)
+{
+    int i, b, num_blocks = get_num_threads();
+    double total, done = 0.0;
+
+    num_blocks = num_blocks > 1 ? num_blocks * ROW_BLOCKS_PER_THREAD : 1;
+    if (num_blocks > rows)
+    {
+        num_blocks = rows > 0 ? rows : 1;
+    }
+    if ((blocks->block_start = (int *)malloc((num_blocks + 1) * sizeof(int))) == NULL)
+    {
+        return 1;
+    }
+
+    total = triangular ? (double)rows * (rows + 1) / 2 : (double)rows;
+    blocks->block_start[0] = 0;
+    for (i = 0, b = 1; i < rows && b < num_blocks; i++)
+    {
+        done += triangular ? rows - i : 1;
+        if (done >= total * b / num_blocks)
+        {
+            blocks->block_start[b++] = i + 1;
+        }
+    }
+    while (b <= num_blocks)
+    {
+        blocks->block_start[b++] = rows;
+    }
+    blocks->num_blocks = num_blocks;
+    blocks->next_block = 0;
+    return 0;
+}
+
+static int claim_row_block(RowBlocks *blocks, int *first, int *last)
+{
+    int b = __sync_fetch_and_add(&blocks->next_block, 1);
+    if (b >= blocks->num_blocks)
+    {
+        return 0;
+    }
+    *first = blocks->block_start[b];
+    *last = blocks->block_start[b + 1];
+    return 1;
+}
+
+/* Runs a row task over freshly initialized row blocks; returns 1 if the blocks cannot be allocated */
+static int run_row_task(ParallelTask task, SymmetricTask *args, int rows, int triangular)
+{
+    if (init_row_blocks(&args->blocks, rows, triangular) != 0)
+    {
+        return 1;
+    }
+    parallel_run(task, args);
+    free(args->blocks.block_start);
+    return 0;
+}
+
+/* Contiguous share of rows [0, rows) owned by one thread in a statically scheduled loop */
+static void static_row_range(int rows, int thread_id, int num_threads, int *first, int *last)
+{
+    *first = (int)((long)rows * thread_id / num_threads);
+    *last = (int)((long)rows * (thread_id + 1) / num_threads);
+}
+
+/* Similarity, degree and normalization stages */
+
+static void similarity_rows_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    const Matrix *d_points = task->d_points;
+    int i, j, first, last;
+    int vec_number = d_points->rows;
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            const double *point = MATRIX_ROW(d_points, i);
+            double *row = task->packed ? PACKED_ROW(task->packed, i) : MATRIX_ROW(task->dense, i);
+            row[i] = 0;
+            squared_distances_to_points(point, d_points, i + 1, vec_number, row + i + 1);
+            gaussian_affinity_block(row + i + 1, vec_number - i - 1);
+            if (task->dense)
+            {
+                for (j = i + 1; j < vec_number; j++)
+                {
+                    MATRIX_AT(task->dense, j, i) = row[j];
+                }
+            }
+        }
+    }
+}
+
+static void squared_norms_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    const Matrix *d_points = task->d_points;
+    int i, j, first, last;
+
+    static_row_range(d_points->rows, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        const double *point = MATRIX_ROW(d_points, i);
+        double sum = 0.0;
+        for (j = 0; j < d_points->cols; j++)
+        {
+            sum += point[j] * point[j];
+        }
+        task->sums[i] = sum;
+    }
+}
+
+/* Turns the dot products of one tile into affinities of rows [tile_row, tile_row + tile->rows)
+ * against columns [tile_col, tile_col + tile->cols); only the entries above the diagonal are kept */
+static void gemm_similarity_tile_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    const Matrix *d_points = task->d_points;
+    const double *norms = task->sums;
+    int r, j, first, last;
+    int col_end = task->tile_col + task->tile->cols;
+
+    static_row_range(task->tile->rows, thread_id, num_threads, &first, &last);
+    for (r = first; r < last; r++)
+    {
+        int i = task->tile_row + r;
+        int start = (i + 1 > task->tile_col) ? i + 1 : task->tile_col;
+        const double *dots = MATRIX_ROW(task->tile, r) - task->tile_col;
+        double *row = task->packed ? PACKED_ROW(task->packed, i) : MATRIX_ROW(task->dense, i);
+        if (i >= task->tile_col && i < col_end)
+        {
+            row[i] = 0;
+        }
+        if (start >= col_end)
+        {
+            continue;
+        }
+        for (j = start; j < col_end; j++)
+        {
+            double norm_sum = norms[i] + norms[j];
+            double distance = norm_sum - 2.0 * dots[j];
+            if (distance < DISTANCE_GEMM_RECOMPUTE * norm_sum)
+            {
+                distance = squared_euclidean_distance(MATRIX_ROW(d_points, i), MATRIX_ROW(d_points, j), d_points->cols);
+            }
+            row[j] = distance;
+        }
+        gaussian_affinity_block(row + start, col_end - start);
+        if (task->dense)
+        {
+            for (j = start; j < col_end; j++)
+            {
+                MATRIX_AT(task->dense, j, i) = row[j];
+            }
+        }
+    }
+}
+
+/* Upper triangle of the affinity matrix in bands of rows; every band is multiplied by the points
+ * at and after its first row, one column tile at a time, so the scratch stays DISTANCE_GEMM_BAND
+ * x DISTANCE_GEMM_TILE whatever the size of the data */
+static int gemm_similarity(SymmetricTask *task)
+{
+    const Matrix *d_points = task->d_points;
+    int n = d_points->rows, i0, j0, failed = 0;
+    Matrix *scratch;
+    Matrix band, points, tile;
+
+    task->sums = (double *)malloc((n ? n : 1) * sizeof(double));
+    scratch = init_matrix(n < DISTANCE_GEMM_BAND ? n : DISTANCE_GEMM_BAND, n < DISTANCE_GEMM_TILE ? n : DISTANCE_GEMM_TILE);
+    if (task->sums == NULL || scratch == NULL)
+    {
+        free(task->sums);
+        free_matrix_memory(scratch);
+        return 1;
+    }
+    parallel_run(squared_norms_task, task);
+
+    band = *d_points;
+    points = *d_points;
+    tile = *scratch;
+    for (i0 = 0; i0 < n && !failed; i0 += DISTANCE_GEMM_BAND)
+    {
+        band.data = MATRIX_ROW(d_points, i0);
+        band.rows = (n - i0 < DISTANCE_GEMM_BAND) ? n - i0 : DISTANCE_GEMM_BAND;
+        for (j0 = i0; j0 < n && !failed; j0 += DISTANCE_GEMM_TILE)
+        {
+            points.data = MATRIX_ROW(d_points, j0);
+            points.rows = (n - j0 < DISTANCE_GEMM_TILE) ? n - j0 : DISTANCE_GEMM_TILE;
+            tile.rows = band.rows;
+            tile.cols = points.rows;
+            if ((failed = gemm(0, 1, &band, &points, &tile, 0)) != 0)
+            {
+                break;
+            }
+            task->tile = &tile;
+            task->tile_row = i0;
+            task->tile_col = j0;
+            parallel_run(gemm_similarity_tile_task, task);
+        }
+    }
+    free(task->sums);
+    task->sums = NULL;
+    free_matrix_memory(scratch);
+    return failed;
+}
+
+static int use_gemm_distances(const Matrix *d_points)
+{
+    const char *method = getenv("SYMNMF_DISTANCE");
+    if (method != NULL && !strcmp(method, "gemm"))
+    {
+        return 1;
+    }
+    if (method != NULL && !strcmp(method, "direct"))
+    {
+        return 0;
+    }
+    return d_points->cols >= DISTANCE_GEMM_MIN_DIM;
+}
+
+/* Fills task->dense or task->packed with the affinities of task->d_points */
+static int build_similarity(SymmetricTask *task)
+{
+    if (use_gemm_distances(task->d_points))
+    {
+        return gemm_similarity(task);
+    }
+    return run_row_task(similarity_rows_task, task, task->d_points->rows, 1);
+}
+
+/* Only the pairs i < j are evaluated; the lower triangle is a mirror of the upper one */
+Matrix *calc_similarity_matrix(const Matrix *d_points)
+{
+    SymmetricTask task;
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    if ((task.dense = init_matrix(d_points->rows, d_points->rows)) == NULL)
+    {
+        return NULL;
+    }
+    if (build_similarity(&task) != 0)
+    {
+        free_matrix_memory(task.dense);
+        return NULL;
+    }
+    return task.dense;
+}
+
+PackedMatrix *calc_packed_similarity_matrix(const Matrix *d_points)
+{
+    SymmetricTask task;
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    if ((task.packed = init_packed_matrix(d_points->rows)) == NULL)
+    {
+        return NULL;
+    }
+    if (build_similarity(&task) != 0)
+    {
+        free_packed_matrix(task.packed);
+        return NULL;
+    }
+    return task.packed;
+}
+
+static void row_sums_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    int i, first, last;
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            task->sums[i] = sum_vector_coordinates(MATRIX_ROW(task->dense, i), task->dense->cols);
+        }
+    }
+}
+
+double *calc_row_sums(const Matrix *matrix)
+{
+    SymmetricTask task;
+    memset(&task, 0, sizeof(task));
+    task.dense = (Matrix *)matrix;
+    if ((task.sums = (double *)malloc((matrix->rows ? matrix->rows : 1) * sizeof(double))) == NULL)
+    {
+        return NULL;
+    }
+    if (run_row_task(row_sums_task, &task, matrix->rows, 0) != 0)
+    {
+        free(task.sums);
+        return NULL;
+    }
+    return task.sums;
+}
+
+/* A block of columns [first, last) first collects the entries stored above the diagonal in
+ * that strip (rows 0..j-1 of column j, in row order), then adds the stored part of row j itself.
+ * Each block costs about n * (last - first), and every sum is added in the serial order. */
+static void packed_row_sums_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    const PackedMatrix *matrix = task->packed;
+    double *sums = task->sums;
+    int i, j, first, last;
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (j = first; j < last; j++)
+        {
+            sums[j] = 0.0;
+        }
+        for (i = 0; i < last - 1; i++)
+        {
+            const double *row = PACKED_ROW(matrix, i);
+            for (j = (i + 1 > first) ? i + 1 : first; j < last; j++)
+            {
+                sums[j] += row[j];
+            }
+        }
+        for (i = first; i < last; i++)
+        {
+            const double *row = PACKED_ROW(matrix, i);
+            double sum = sums[i];
+            for (j = i; j < matrix->size; j++)
+            {
+                sum += row[j];
+            }
+            sums[i] = sum;
+        }
+    }
+}
+
+/* Row i of a symmetric matrix is its stored part (j >= i) plus column i above the diagonal */
+double *calc_packed_row_sums(const PackedMatrix *matrix)
+{
+    SymmetricTask task;
+    memset(&task, 0, sizeof(task));
+    task.packed = (PackedMatrix *)matrix;
+    if ((task.sums = (double *)malloc((matrix->size ? matrix->size : 1) * sizeof(double))) == NULL)
+    {
+        return NULL;
+    }
+    if (run_row_task(packed_row_sums_task, &task, matrix->size, 0) != 0)
+    {
+        free(task.sums);
+        return NULL;
+    }
+    return task.sums;
+}
+
+/* sums[i] = sum_j a_ij, or the upper-triangle sum_{j > i} a_ij * weights[j] when weights are set */
+static void degree_rows_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    const Matrix *d_points = task->d_points;
+    const double *weights = task->weights;
+    int i, j, j0, first, last;
+    int vec_number = d_points->rows;
+    double distances[DISTANCE_BLOCK];
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            const double *point = MATRIX_ROW(d_points, i);
+            double sum = 0.0;
+            for (j0 = weights ? i + 1 : 0; j0 < vec_number; j0 += DISTANCE_BLOCK)
+            {
+                int j1 = (vec_number - j0 < DISTANCE_BLOCK) ? vec_number : j0 + DISTANCE_BLOCK;
+                squared_distances_to_points(point, d_points, j0, j1, distances);
+                gaussian_affinity_block(distances, j1 - j0);
+                for (j = j0; j < j1 && weights == NULL; j++)
+                {
+                    sum += (i == j) ? 0 : distances[j - j0];
+                }
+                for (j = j0; j < j1 && weights != NULL; j++)
+                {
+                    sum += (i == j) ? 0 : distances[j - j0] * weights[j];
+                }
+            }
+            task->sums[i] = sum;
+        }
+    }
+}
+
+/* Degrees d_i = sum_j a_ij accumulated straight from the data points, O(n) extra memory */
+double *calc_degree_vector(const Matrix *d_points)
+{
+    SymmetricTask task;
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    if ((task.sums = (double *)malloc((d_points->rows ? d_points->rows : 1) * sizeof(double))) == NULL)
+    {
+        return NULL;
+    }
+    if (run_row_task(degree_rows_task, &task, d_points->rows, 0) != 0)
+    {
+        free(task.sums);
+        return NULL;
+    }
+    return task.sums;
+}
+
+Matrix *calc_diagonal_matrix(const Matrix *d_points)
+{
+    int i;
+    int vec_number = d_points->rows;
+    Matrix *matrix;
+    double *degrees = calc_degree_vector(d_points);
+    if (degrees == NULL)
+    {
+        return NULL;
+    }
+    if ((matrix = init_matrix(vec_number, vec_number)) == NULL)
+    {
+        free(degrees);
+        return NULL;
+    }
+
+    for (i = 0; i < vec_number; i++)
+    {
+        MATRIX_AT(matrix, i, i) = degrees[i];
+    }
+    free(degrees);
+    return matrix;
+}
+
+/* The diagonal degree matrix in packed storage: only the n diagonal entries are nonzero */
+PackedMatrix *calc_packed_diagonal_matrix(const Matrix *d_points)
+{
+    int i;
+    PackedMatrix *matrix;
+    double *degrees = calc_degree_vector(d_points);
+    if (degrees == NULL)
+    {
+        return NULL;
+    }
+    if ((matrix = init_packed_matrix(d_points->rows)) == NULL)
+    {
+        free(degrees);
+        return NULL;
+    }
+
+    for (i = 0; i < d_points->rows; i++)
+    {
+        PACKED_ROW(matrix, i)[i] = degrees[i];
+    }
+    free(degrees);
+    return matrix;
+}
+
+static void normalize_rows_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    const double *inv_sqrt = task->sums;
+    int i, j, first, last;
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            double scale = inv_sqrt[i];
+            if (task->packed)
+            {
+                double *row = PACKED_ROW(task->packed, i);
+                for (j = i; j < task->packed->size; j++)
+                {
+                    row[j] = (scale * row[j]) * inv_sqrt[j];
+                }
+            }
+            else
+            {
+                double *row = MATRIX_ROW(task->dense, i);
+                for (j = 0; j < task->dense->cols; j++)
+                {
+                    row[j] = (scale * row[j]) * inv_sqrt[j];
+                }
+            }
+        }
+    }
+}
+
+static int normalize_by_degrees(SymmetricTask *task, int size, const double *degrees)
+{
+    int i, status;
+    if ((task->sums = (double *)malloc((size ? size : 1) * sizeof(double))) == NULL)
+    {
+        return 1;
+    }
+    for (i = 0; i < size; ++i)
+    {
+        task->sums[i] = 1 / sqrt(degrees[i]);
+    }
+    status = run_row_task(normalize_rows_task, task, size, task->packed != NULL);
+    free(task->sums);
+    return status;
+}
+
+/* Scales A in place into D^-1/2 * A * D^-1/2; D is diagonal, so this is O(n^2) */
+int normalize_similarity_matrix(Matrix *A, const double *degrees)
+{
+    SymmetricTask task;
+    memset(&task, 0, sizeof(task));
+    task.dense = A;
+    return normalize_by_degrees(&task, A->rows, degrees);
+}
+
+Matrix *calc_normalized_similarity_matrix(const Matrix *d_points)
+{
+    double *degrees;
+    Matrix *A = calc_similarity_matrix(d_points);
+    if (A == NULL)
+    {
+        return NULL;
+    }
+    if ((degrees = calc_row_sums(A)) == NULL || normalize_similarity_matrix(A, degrees) != 0)
+    {
+        free(degrees);
+        free_matrix_memory(A);
+        return NULL;
+    }
+
+    free(degrees);
+    return A;
+}
+
+int normalize_packed_similarity_matrix(PackedMatrix *A, const double *degrees)
+{
+    SymmetricTask task;
+    memset(&task, 0, sizeof(task));
+    task.packed = A;
+    return normalize_by_degrees(&task, A->size, degrees);
+}
+
+PackedMatrix *calc_packed_normalized_similarity_matrix(const Matrix *d_points)
+{
+    double *degrees;
+    PackedMatrix *A = calc_packed_similarity_matrix(d_points);
+    if (A == NULL)
+    {
+        return NULL;
+    }
+    if ((degrees = calc_packed_row_sums(A)) == NULL || normalize_packed_similarity_matrix(A, degrees) != 0)
+    {
+        free(degrees);
+        free_packed_matrix(A);
+        return NULL;
+    }
+
+    free(degrees);
+    return A;
+}
+
+/* Normalized rows rebuilt from the points in DISTANCE_BLOCK tiles of doubles, with the scaling
+ * of normalize_packed_similarity_matrix, and rounded to float only when stored */
+static void float_normalized_rows_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    const Matrix *d_points = task->d_points;
+    const double *inv_sqrt = task->sums;
+    double tile[DISTANCE_BLOCK];
+    int i, j, j0, first, last, n = d_points->rows;
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            float *row = PACKED_ROW(task->packed_float, i);
+            row[i] = 0.0f;
+            for (j0 = i + 1; j0 < n; j0 += DISTANCE_BLOCK)
+            {
+                int j1 = j0 + DISTANCE_BLOCK < n ? j0 + DISTANCE_BLOCK : n;
+                squared_distances_to_points(MATRIX_ROW(d_points, i), d_points, j0, j1, tile);
+                gaussian_affinity_block(tile, j1 - j0);
+                for (j = j0; j < j1; j++)
+                {
+                    row[j] = (float)((inv_sqrt[i] * tile[j - j0]) * inv_sqrt[j]);
+                }
+            }
+        }
+    }
+}
+
+/* W in float at half the memory of the packed double W. The degrees are summed in double from
+ * the unrounded affinities first, so only the stored entries carry the float rounding. */
+PackedFloatMatrix *calc_packed_float_normalized_similarity_matrix(const Matrix *d_points)
+{
+    int i, n = d_points->rows;
+    SymmetricTask task;
+    double *degrees = calc_degree_vector(d_points);
+
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    if (degrees == NULL || (task.packed_float = init_packed_float_matrix(n)) == NULL)
+    {
+        free(degrees);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+    {
+        degrees[i] = 1 / sqrt(degrees[i]);
+    }
+    task.sums = degrees;
+    if (run_row_task(float_normalized_rows_task, &task, n, 1) != 0)
+    {
+        free_packed_float_matrix(task.packed_float);
+        task.packed_float = NULL;
+    }
+    free(degrees);
+    return task.packed_float;
+}
+
+/* KD-tree over the data points, shared by the kNN and radius graphs: median splits on the
+ * widest coordinate and a bounding box per node, which pays off for low dimensions. */
+
+/* Reorders order[first, last) so that order[nth] has the nth smallest coordinate dim */
+static void kd_select(const Matrix *points, int *order, int first, int last, int nth, int dim)
+{
+    while (last - first > 1)
+    {
+        double pivot = MATRIX_AT(points, order[first + (last - first) / 2], dim);
+        int i = first, j = last - 1, swap;
+        while (i <= j)
+        {
+            while (MATRIX_AT(points, order[i], dim) < pivot)
+            {
+                i++;
+            }
+            while (MATRIX_AT(points, order[j], dim) > pivot)
+            {
+                j--;
+            }
+            if (i <= j)
+            {
+                swap = order[i];
+                order[i++] = order[j];
+                order[j--] = swap;
+            }
+        }
+        if (nth <= j)
+        {
+            last = j + 1;
+        }
+        else if (nth >= i)
+        {
+            first = i;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/* Builds the subtree over order[first, last) and returns its node index */
+static int kd_build(KdTree *tree, int first, int last)
+{
+    const Matrix *points = tree->d_points;
+    int i, c, dim = 0, mid, node = tree->num_nodes++, d = points->cols;
+    double *lo = tree->bounds + (size_t)node * 2 * d, *hi = lo + d;
+
+    for (c = 0; c < d; c++)
+    {
+        lo[c] = hi[c] = MATRIX_AT(points, tree->order[first], c);
+    }
+    for (i = first + 1; i < last; i++)
+    {
+        const double *point = MATRIX_ROW(points, tree->order[i]);
+        for (c = 0; c < d; c++)
+        {
+            lo[c] = point[c] < lo[c] ? point[c] : lo[c];
+            hi[c] = point[c] > hi[c] ? point[c] : hi[c];
+        }
+    }
+    tree->nodes[node].first = first;
+    tree->nodes[node].last = last;
+    tree->nodes[node].left = tree->nodes[node].right = -1;
+    if (last - first <= KD_LEAF_SIZE)
+    {
+        return node;
+    }
+
+    for (c = 1; c < d; c++)
+    {
+        dim = (hi[c] - lo[c] > hi[dim] - lo[dim]) ? c : dim;
+    }
+    mid = first + (last - first) / 2;
+    kd_select(points, tree->order, first, last, mid, dim);
+    tree->nodes[node].left = kd_build(tree, first, mid);
+    tree->nodes[node].right = kd_build(tree, mid, last);
+    return node;
+}
+
+/* Leaves hold more than KD_LEAF_SIZE / 2 points, so 4n / KD_LEAF_SIZE + 3 nodes always suffice */
+static int init_kd_tree(KdTree *tree, const Matrix *d_points)
+{
+    int i, n = d_points->rows, capacity = 4 * (n / KD_LEAF_SIZE) + 3;
+    tree->d_points = d_points;
+    tree->num_nodes = 0;
+    tree->order = (int *)malloc((n ? n : 1) * sizeof(int));
+    tree->nodes = (KdNode *)malloc(capacity * sizeof(KdNode));
+    tree->bounds = (double *)malloc(((size_t)capacity * 2 * d_points->cols + 1) * sizeof(double));
+    if (tree->order == NULL || tree->nodes == NULL || tree->bounds == NULL)
+    {
+        free(tree->order);
+        free(tree->nodes);
+        free(tree->bounds);
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        tree->order[i] = i;
+    }
+    if (n > 0)
+    {
+        kd_build(tree, 0, n);
+    }
+    return 0;
+}
+
+static void free_kd_tree(KdTree *tree)
+{
+    free(tree->order);
+    free(tree->nodes);
+    free(tree->bounds);
+}
+
+/* Squared distance from point to the bounding box of a node; never more than the true distance
+ * to any point inside it */
+static double kd_box_distance(const KdTree *tree, int node, const double *point)
+{
+    int c, d = tree->d_points->cols;
+    const double *lo = tree->bounds + (size_t)node * 2 * d, *hi = lo + d;
+    double sum = 0.0;
+    for (c = 0; c < d; c++)
+    {
+        double gap = point[c] < lo[c] ? lo[c] - point[c] : (point[c] > hi[c] ? point[c] - hi[c] : 0.0);
+        sum += gap * gap;
+    }
+    return sum;
+}
+
+/* Sparse k-nearest-neighbor affinities. Every point keeps its `neighbors` closest points (ties
+ * broken by the smaller index), found by a depth-first KD-tree search that skips every box
+ * farther away than the current worst neighbor. The graph is then symmetrized by union, so a_ij
+ * is stored when j is among the neighbors of i or i among those of j. Memory is O(n * neighbors). */
+
+static int knn_is_worse(double distance_a, int col_a, double distance_b, int col_b)
+{
+    return distance_a > distance_b || (distance_a == distance_b && col_a > col_b);
+}
+
+/* Restores the max-heap order of (distances, cols) below position i */
+static void knn_sift_down(double *distances, int *cols, int size, int i)
+{
+    for (;;)
+    {
+        int worst = i, left = 2 * i + 1, right = 2 * i + 2;
+        double distance;
+        int col;
+        if (left < size && knn_is_worse(distances[left], cols[left], distances[worst], cols[worst]))
+        {
+            worst = left;
+        }
+        if (right < size && knn_is_worse(distances[right], cols[right], distances[worst], cols[worst]))
+        {
+            worst = right;
+        }
+        if (worst == i)
+        {
+            return;
+        }
+        distance = distances[i];
+        col = cols[i];
+        distances[i] = distances[worst];
+        cols[i] = cols[worst];
+        distances[worst] = distance;
+        cols[worst] = col;
+        i = worst;
+    }
+}
+
+/* Offers (distance, col) to a max-heap that keeps the k best candidates seen so far */
+static void knn_push(double *distances, int *cols, int *size, int k, double distance, int col)
+{
+    int child, parent;
+    if (*size == k)
+    {
+        if (knn_is_worse(distances[0], cols[0], distance, col))
+        {
+            distances[0] = distance;
+            cols[0] = col;
+            knn_sift_down(distances, cols, k, 0);
+        }
+        return;
+    }
+    child = (*size)++;
+    distances[child] = distance;
+    cols[child] = col;
+    while (child > 0 && knn_is_worse(distance, col, distances[(child - 1) / 2], cols[(child - 1) / 2]))
+    {
+        parent = (child - 1) / 2;
+        distances[child] = distances[parent];
+        cols[child] = cols[parent];
+        distances[parent] = distance;
+        cols[parent] = col;
+        child = parent;
+    }
+}
+
+/* The nearer child is visited first, and a box is pruned only when it is farther than the worst
+ * kept neighbor by more than the slack, so tied points are still found and the result matches an
+ * exhaustive scan */
+static void knn_rows_task(void *arg, int thread_id, int num_threads)
+{
+    KnnTask *task = (KnnTask *)arg;
+    const KdTree *tree = task->tree;
+    const Matrix *d_points = task->d_points;
+    int i, p, first, last, size, depth, k = task->neighbors;
+    int stack[KD_MAX_DEPTH];
+    double stack_bounds[KD_MAX_DEPTH];
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last && k > 0; i++)
+        {
+            const double *point = MATRIX_ROW(d_points, i);
+            double *heap_distances = task->distances + (size_t)i * k;
+            int *heap_cols = task->cols + (size_t)i * k;
+            size = 0;
+            depth = 0;
+            stack[depth] = 0;
+            stack_bounds[depth++] = 0.0;
+            while (depth > 0)
+            {
+                const KdNode *node = tree->nodes + stack[--depth];
+                double near_bound, far_bound;
+                int near, far;
+                if (size == k && stack_bounds[depth] > heap_distances[0] * (1 + KD_PRUNE_SLACK))
+                {
+                    continue;
+                }
+                if (node->left >= 0)
+                {
+                    near = node->left;
+                    far = node->right;
+                    near_bound = kd_box_distance(tree, near, point);
+                    far_bound = kd_box_distance(tree, far, point);
+                    if (far_bound < near_bound)
+                    {
+                        double bound = near_bound;
+                        near_bound = far_bound;
+                        far_bound = bound;
+                        near = node->right;
+                        far = node->left;
+                    }
+                    stack[depth] = far;
+                    stack_bounds[depth++] = far_bound;
+                    stack[depth] = near;
+                    stack_bounds[depth++] = near_bound;
+                    continue;
+                }
+                for (p = node->first; p < node->last; p++)
+                {
+                    int j = tree->order[p];
+                    double distance;
+                    if (j == i)
+                    {
+                        continue;
+                    }
+                    squared_distances_to_points(point, d_points, j, j + 1, &distance);
+                    knn_push(heap_distances, heap_cols, &size, k, distance, j);
+                }
+            }
+        }
+    }
+}
+
+static int compare_sparse_entries(const void *a, const void *b)
+{
+    int col_a = ((const SparseEntry *)a)->col, col_b = ((const SparseEntry *)b)->col;
+    return (col_a > col_b) - (col_a < col_b);
+}
+
+/* Sorts every row of the union by column and drops the pairs found from both sides */
+static void merge_sparse_rows_task(void *arg, int thread_id, int num_threads)
+{
+    KnnTask *task = (KnnTask *)arg;
+    int i, first, last;
+    size_t e, kept;
+
+    static_row_range(task->d_points->rows, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        SparseEntry *row = task->entries + task->entry_start[i];
+        size_t count = task->entry_start[i + 1] - task->entry_start[i];
+        qsort(row, count, sizeof(SparseEntry), compare_sparse_entries);
+        for (e = 0, kept = 0; e < count; e++)
+        {
+            if (kept == 0 || row[kept - 1].col != row[e].col)
+            {
+                row[kept++] = row[e];
+            }
+        }
+        task->row_count[i] = kept;
+    }
+}
+
+static void fill_sparse_rows_task(void *arg, int thread_id, int num_threads)
+{
+    KnnTask *task = (KnnTask *)arg;
+    SparseMatrix *sparse = task->sparse;
+    int i, first, last;
+    size_t e;
+
+    static_row_range(sparse->size, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        const SparseEntry *row = task->entries + task->entry_start[i];
+        size_t start = sparse->row_start[i];
+        size_t count = sparse->row_start[i + 1] - start;
+        for (e = 0; e < count; e++)
+        {
+            sparse->cols[start + e] = row[e].col;
+            sparse->values[start + e] = row[e].value;
+        }
+        gaussian_affinity_block(sparse->values + start, (int)count);
+    }
+}
+
+/* Sorts and merges the rows laid out in task->entries, whose values are squared distances, and
+ * turns them into the CSR affinity matrix */
+static SparseMatrix *sparse_from_entries(KnnTask *task)
+{
+    int i, n = task->d_points->rows;
+    SparseMatrix *sparse;
+
+    parallel_run(merge_sparse_rows_task, task);
+    for (i = 1; i < n; i++)
+    {
+        task->row_count[i] += task->row_count[i - 1];
+    }
+    if ((sparse = init_sparse_matrix(n, n > 0 ? task->row_count[n - 1] : 0)) == NULL)
+    {
+        return NULL;
+    }
+    sparse->row_start[0] = 0;
+    for (i = 0; i < n; i++)
+    {
+        sparse->row_start[i + 1] = task->row_count[i];
+    }
+    task->sparse = sparse;
+    parallel_run(fill_sparse_rows_task, task);
+    return sparse;
+}
+
+/* Lays the directed neighbor lists and their reverses out row by row, then merges each row */
+static SparseMatrix *knn_symmetrize(KnnTask *task)
+{
+    int i, t, n = task->d_points->rows, k = task->neighbors;
+    size_t *fill;
+
+    task->entry_start = (size_t *)calloc((size_t)n + 1, sizeof(size_t));
+    task->row_count = (size_t *)malloc(((size_t)n + 1) * sizeof(size_t));
+    task->entries = (SparseEntry *)malloc(((size_t)n * k * 2 + 1) * sizeof(SparseEntry));
+    fill = (size_t *)malloc(((size_t)n + 1) * sizeof(size_t));
+    if (task->entry_start == NULL || task->row_count == NULL || task->entries == NULL || fill == NULL)
+    {
+        free(fill);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        task->entry_start[i + 1] += k;
+        for (t = 0; t < k; t++)
+        {
+            task->entry_start[task->cols[(size_t)i * k + t] + 1]++;
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        task->entry_start[i + 1] += task->entry_start[i];
+        fill[i] = task->entry_start[i];
+    }
+    for (i = 0; i < n; i++)
+    {
+        for (t = 0; t < k; t++)
+        {
+            int j = task->cols[(size_t)i * k + t];
+            double distance = task->distances[(size_t)i * k + t];
+            task->entries[fill[i]].col = j;
+            task->entries[fill[i]++].value = distance;
+            task->entries[fill[j]].col = i;
+            task->entries[fill[j]++].value = distance;
+        }
+    }
+    free(fill);
+    return sparse_from_entries(task);
+}
+
+SparseMatrix *calc_knn_similarity_matrix(const Matrix *d_points, int neighbors)
+{
+    KnnTask task;
+    KdTree tree;
+    SparseMatrix *sparse = NULL;
+    int n = d_points->rows;
+
+    if (neighbors < 1 || init_kd_tree(&tree, d_points) != 0)
+    {
+        return NULL;
+    }
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    task.tree = &tree;
+    task.neighbors = neighbors < n - 1 ? neighbors : (n > 1 ? n - 1 : 0);
+    task.cols = (int *)malloc(((size_t)n * task.neighbors + 1) * sizeof(int));
+    task.distances = (double *)malloc(((size_t)n * task.neighbors + 1) * sizeof(double));
+    if (task.cols != NULL && task.distances != NULL && init_row_blocks(&task.blocks, n, 0) == 0)
+    {
+        parallel_run(knn_rows_task, &task);
+        free(task.blocks.block_start);
+        sparse = knn_symmetrize(&task);
+    }
+    free_kd_tree(&tree);
+    free(task.cols);
+    free(task.distances);
+    free(task.entry_start);
+    free(task.row_count);
+    free(task.entries);
+    return sparse;
+}
+
+static void sparse_row_sums_task(void *arg, int thread_id, int num_threads)
+{
+    SparseRowsTask *task = (SparseRowsTask *)arg;
+    const SparseMatrix *matrix = task->matrix;
+    int i, first, last;
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            size_t start = matrix->row_start[i];
+            task->scale[i] = sum_vector_coordinates(matrix->values + start, (int)(matrix->row_start[i + 1] - start));
+        }
+    }
+}
+
+double *calc_sparse_row_sums(const SparseMatrix *matrix)
+{
+    SparseRowsTask task;
+    memset(&task, 0, sizeof(task));
+    task.matrix = matrix;
+    task.scale = (double *)malloc((matrix->size ? matrix->size : 1) * sizeof(double));
+    if (task.scale == NULL || (matrix->size > 0 && init_row_blocks(&task.blocks, matrix->size, 0) != 0))
+    {
+        free(task.scale);
+        return NULL;
+    }
+    if (matrix->size > 0)
+    {
+        parallel_run(sparse_row_sums_task, &task);
+        free(task.blocks.block_start);
+    }
+    return task.scale;
+}
+
+static void normalize_sparse_rows_task(void *arg, int thread_id, int num_threads)
+{
+    SparseRowsTask *task = (SparseRowsTask *)arg;
+    const SparseMatrix *A = task->matrix;
+    const double *inv_sqrt = task->scale;
+    int i, first, last;
+    size_t e;
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            for (e = A->row_start[i]; e < A->row_start[i + 1]; e++)
+            {
+                int j = A->cols[e];
+                A->values[e] = (i < j) ? (inv_sqrt[i] * A->values[e]) * inv_sqrt[j]
+                                       : (inv_sqrt[j] * A->values[e]) * inv_sqrt[i];
+            }
+        }
+    }
+}
+
+/* Scales the stored entries of A in place into D^-1/2 * A * D^-1/2. Both copies of a pair are
+ * scaled in the packed order, smaller index first, so the result stays exactly symmetric. */
+int normalize_sparse_similarity_matrix(SparseMatrix *A, const double *degrees)
+{
+    SparseRowsTask task;
+    int i;
+    if (A->size == 0)
+    {
+        return 0;
+    }
+    memset(&task, 0, sizeof(task));
+    task.matrix = A;
+    task.scale = (double *)malloc(A->size * sizeof(double));
+    if (task.scale == NULL || init_row_blocks(&task.blocks, A->size, 0) != 0)
+    {
+        free(task.scale);
+        return 1;
+    }
+    for (i = 0; i < A->size; ++i)
+    {
+        task.scale[i] = 1 / sqrt(degrees[i]);
+    }
+    parallel_run(normalize_sparse_rows_task, &task);
+    free(task.blocks.block_start);
+    free(task.scale);
+    return 0;
+}
+
+SparseMatrix *calc_knn_normalized_similarity_matrix(const Matrix *d_points, int neighbors)
+{
+    double *degrees;
+    SparseMatrix *A = calc_knn_similarity_matrix(d_points, neighbors);
+    if (A == NULL)
+    {
+        return NULL;
+    }
+    if ((degrees = calc_sparse_row_sums(A)) == NULL || normalize_sparse_similarity_matrix(A, degrees) != 0)
+    {
+        free(degrees);
+        free_sparse_matrix(A);
+        return NULL;
+    }
+
+    free(degrees);
+    return A;
+}
+
+/* Degrees come from the streaming pass of calc_degree_vector. The total 1^T W 1 = s^T A s with
+ * s = D^-1/2 needs s first, so it takes one more degree pass weighted by s over the upper
+ * triangle. The points are referenced, not copied, and must outlive the affinity. */
+ImplicitAffinity *init_implicit_affinity(const Matrix *d_points)
+{
+    int i;
+    SymmetricTask task;
+    ImplicitAffinity *affinity = (ImplicitAffinity *)malloc(sizeof(ImplicitAffinity));
+    if (affinity == NULL)
+    {
+        return NULL;
+    }
+    affinity->d_points = d_points;
+    affinity->total = 0.0;
+    if ((affinity->inv_sqrt_degrees = calc_degree_vector(d_points)) == NULL)
+    {
+        free(affinity);
+        return NULL;
+    }
+    for (i = 0; i < d_points->rows; ++i)
+    {
+        affinity->inv_sqrt_degrees[i] = 1 / sqrt(affinity->inv_sqrt_degrees[i]);
+    }
+
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    task.weights = affinity->inv_sqrt_degrees;
+    task.sums = (double *)malloc((d_points->rows ? d_points->rows : 1) * sizeof(double));
+    if (task.sums == NULL || run_row_task(degree_rows_task, &task, d_points->rows, 1) != 0)
+    {
+        free(task.sums);
+        free_implicit_affinity(affinity);
+        return NULL;
+    }
+    for (i = 0; i < d_points->rows; ++i)
+    {
+        affinity->total += 2 * affinity->inv_sqrt_degrees[i] * task.sums[i];
+    }
+    free(task.sums);
+    return affinity;
+}
+
+void free_implicit_affinity(ImplicitAffinity *affinity)
+{
+    if (!affinity)
+    {
+        return;
+    }
+    free(affinity->inv_sqrt_degrees);
+    free(affinity);
+}
+
+/* Radius-truncated affinities. exp(-d/2) < tolerance exactly when d > -2 ln(tolerance), so
+ * keeping every pair within that squared radius gives a sparse A that differs from the dense
+ * one by less than tolerance in every entry. The pairs are found with the KD-tree. */
+
+/* Visits every point within the squared radius of point i: counts them into entry_start[i + 1]
+ * while task->entries is NULL, otherwise writes them from entry_start[i] on */
+static void radius_rows_task(void *arg, int thread_id, int num_threads)
+{
+    KnnTask *task = (KnnTask *)arg;
+    const KdTree *tree = task->tree;
+    const Matrix *d_points = task->d_points;
+    double prune = task->radius * (1 + KD_PRUNE_SLACK);
+    int i, p, first, last, depth, stack[KD_MAX_DEPTH];
+    (void)thread_id;
+    (void)num_threads;
+
+    while (claim_row_block(&task->blocks, &first, &last))
+    {
+        for (i = first; i < last; i++)
+        {
+            const double *point = MATRIX_ROW(d_points, i);
+            size_t found = 0;
+            SparseEntry *row = task->entries ? task->entries + task->entry_start[i] : NULL;
+            depth = 0;
+            stack[depth++] = 0;
+            while (depth > 0)
+            {
+                const KdNode *node = tree->nodes + stack[--depth];
+                if (kd_box_distance(tree, (int)(node - tree->nodes), point) > prune)
+                {
+                    continue;
+                }
+                if (node->left >= 0)
+                {
+                    stack[depth++] = node->right;
+                    stack[depth++] = node->left;
+                    continue;
+                }
+                for (p = node->first; p < node->last; p++)
+                {
+                    int j = tree->order[p];
+                    double distance;
+                    if (j == i)
+                    {
+                        continue;
+                    }
+                    squared_distances_to_points(point, d_points, j, j + 1, &distance);
+                    if (distance <= task->radius)
+                    {
+                        if (row != NULL)
+                        {
+                            row[found].col = j;
+                            row[found].value = distance;
+                        }
+                        found++;
+                    }
+                }
+            }
+            if (row == NULL)
+            {
+                task->entry_start[i + 1] = found;
+            }
+        }
+    }
+}
+
+SparseMatrix *calc_radius_similarity_matrix(const Matrix *d_points, double tolerance)
+{
+    KnnTask task;
+    KdTree tree;
+    SparseMatrix *sparse = NULL;
+    int i, n = d_points->rows;
+
+    if (!(tolerance > 0 && tolerance < 1) || init_kd_tree(&tree, d_points) != 0)
+    {
+        return NULL;
+    }
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    task.tree = &tree;
+    task.radius = -2 * log(tolerance);
+    task.entry_start = (size_t *)calloc((size_t)n + 1, sizeof(size_t));
+    task.row_count = (size_t *)malloc(((size_t)n + 1) * sizeof(size_t));
+    if (task.entry_start != NULL && task.row_count != NULL && n > 0 && init_row_blocks(&task.blocks, n, 0) == 0)
+    {
+        parallel_run(radius_rows_task, &task);
+        for (i = 0; i < n; i++)
+        {
+            task.entry_start[i + 1] += task.entry_start[i];
+        }
+        task.entries = (SparseEntry *)malloc((task.entry_start[n] + 1) * sizeof(SparseEntry));
+        if (task.entries != NULL)
+        {
+            task.blocks.next_block = 0;
+            parallel_run(radius_rows_task, &task);
+            sparse = sparse_from_entries(&task);
+        }
+        free(task.blocks.block_start);
+    }
+    free_kd_tree(&tree);
+    free(task.entry_start);
+    free(task.row_count);
+    free(task.entries);
+    return sparse;
+}
+
+SparseMatrix *calc_radius_normalized_similarity_matrix(const Matrix *d_points, double tolerance)
+{
+    double *degrees;
+    SparseMatrix *A = calc_radius_similarity_matrix(d_points, tolerance);
+    if (A == NULL)
+    {
+        return NULL;
+    }
+    if ((degrees = calc_sparse_row_sums(A)) == NULL || normalize_sparse_similarity_matrix(A, degrees) != 0)
+    {
+        free(degrees);
+        free_sparse_matrix(A);
+        return NULL;
+    }
+
+    free(degrees);
+    return A;
+}
+
+/* Nystrom approximation. With C the n x m kernel block against m landmark points and M the
+ * m x m block among them, K ~ C * M^+ * C^T = F * F^T where F = C * V * L^-1/2 over the
+ * eigenpairs (L, V) of M above NYSTROM_EIGEN_CUTOFF of the largest. A = K - I has a zero
+ * diagonal, so the approximate degrees are F * (F^T * 1) - 1 and
+ *     W * H = G * (G^T * H) - D^-1 * H,    G = D^-1/2 * F,
+ * which costs O(n * rank * k). */
+
+/* xorshift64* stream; 64-bit constants are assembled from halves since C89 has no long long */
+static uint64_t nystrom_seed(unsigned long seed)
+{
+    uint64_t golden = ((uint64_t)0x9E3779B9UL << 32) | 0x7F4A7C15UL;
+    return (uint64_t)seed * golden + 1;
+}
+
+static uint64_t nystrom_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * (((uint64_t)0x2545F491UL << 32) | 0x4F6CDD1DUL);
+}
+
+/* Uniform draw in [0, 1) from the top 53 bits */
+static double nystrom_uniform(uint64_t *state)
+{
+    return (double)(nystrom_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Landmarks drawn without replacement: uniformly, or by k-means++ seeding (each next landmark
+ * with probability proportional to its squared distance from the closest one chosen so far).
+ * Returns how many were chosen, fewer than m only when the points run out of distinct values, or
+ * 0 when out of memory. */
+static int choose_landmarks(const Matrix *d_points, int m, int method, uint64_t *state, int *landmarks)
+{
+    int i, t, n = d_points->rows;
+    double *closest;
+
+    if (method != NYSTROM_KMEANSPP)
+    {
+        int *order = (int *)malloc(n * sizeof(int));
+        if (order == NULL)
+        {
+            return 0;
+        }
+        for (i = 0; i < n; i++)
+        {
+            order[i] = i;
+        }
+        for (t = 0; t < m; t++)
+        {
+            int pick = t + (int)(nystrom_uniform(state) * (n - t)), swap = order[t];
+            order[t] = order[pick];
+            order[pick] = swap;
+            landmarks[t] = order[t];
+        }
+        free(order);
+        return m;
+    }
+
+    if ((closest = (double *)malloc(n * sizeof(double))) == NULL)
+    {
+        return 0;
+    }
+    landmarks[0] = (int)(nystrom_uniform(state) * n);
+    squared_distances_to_points(MATRIX_ROW(d_points, landmarks[0]), d_points, 0, n, closest);
+    for (t = 1; t < m; t++)
+    {
+        double total = 0.0, target;
+        int pick = -1;
+        for (i = 0; i < n; i++)
+        {
+            total += closest[i];
+        }
+        target = nystrom_uniform(state) * total;
+        for (i = 0; i < n && pick < 0; i++)
+        {
+            target -= closest[i];
+            pick = target < 0 && closest[i] > 0 ? i : -1;
+        }
+        for (i = n - 1; i >= 0 && pick < 0; i--)
+        {
+            /* rounding ran past the end: take the last point still away from every landmark */
+            pick = closest[i] > 0 ? i : -1;
+        }
+        if (pick < 0)
+        {
+            /* every point coincides with a landmark, so any further choice is a duplicate */
+            break;
+        }
+        landmarks[t] = pick;
+        for (i = 0; i < n; i++)
+        {
+            double distance = squared_euclidean_distance(MATRIX_ROW(d_points, i), MATRIX_ROW(d_points, pick), d_points->cols);
+            closest[i] = distance < closest[i] ? distance : closest[i];
+        }
+    }
+    free(closest);
+    return t;
+}
+
+static void landmark_kernel_task(void *arg, int thread_id, int num_threads)
+{
+    SymmetricTask *task = (SymmetricTask *)arg;
+    int i, first, last;
+
+    static_row_range(task->d_points->rows, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        double *row = MATRIX_ROW(task->dense, i);
+        squared_distances_to_points(MATRIX_ROW(task->d_points, i), task->tile, 0, task->tile->rows, row);
+        gaussian_affinity_block(row, task->tile->rows);
+    }
+}
+
+/* Cyclic Jacobi rotations on the symmetric A (destroyed); eigenvalues end up on the diagonal of
+ * A and the eigenvectors in the rows of V. Each rotation updates rows p and q in place and
+ * mirrors them into columns p and q, so the inner loops stay on contiguous rows. */
+static void jacobi_eigen(Matrix *A, Matrix *V)
+{
+    int p, q, r, sweep, m = A->rows;
+    for (p = 0; p < m; p++)
+    {
+        memset(MATRIX_ROW(V, p), 0, m * sizeof(double));
+        MATRIX_AT(V, p, p) = 1.0;
+    }
+    for (sweep = 0; sweep < JACOBI_MAX_SWEEPS; sweep++)
+    {
+        double off = 0.0, diagonal = 0.0;
+        for (p = 0; p < m; p++)
+        {
+            diagonal += MATRIX_AT(A, p, p) * MATRIX_AT(A, p, p);
+            for (q = p + 1; q < m; q++)
+            {
+                off += MATRIX_AT(A, p, q) * MATRIX_AT(A, p, q);
+            }
+        }
+        if (off <= JACOBI_TOLERANCE * diagonal)
+        {
+            return;
+        }
+        for (p = 0; p < m; p++)
+        {
+            for (q = p + 1; q < m; q++)
+            {
+                double *a_p = MATRIX_ROW(A, p), *a_q = MATRIX_ROW(A, q), *v_p = MATRIX_ROW(V, p), *v_q = MATRIX_ROW(V, q);
+                double apq = a_p[q], app = a_p[p], aqq = a_q[q], theta, t, c, s;
+                if (apq == 0.0)
+                {
+                    continue;
+                }
+                theta = (aqq - app) / (2 * apq);
+                t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+                c = 1 / sqrt(t * t + 1);
+                s = t * c;
+                for (r = 0; r < m; r++)
+                {
+                    double arp = a_p[r], arq = a_q[r], vrp = v_p[r], vrq = v_q[r];
+                    a_p[r] = c * arp - s * arq;
+                    a_q[r] = s * arp + c * arq;
+                    v_p[r] = c * vrp - s * vrq;
+                    v_q[r] = s * vrp + c * vrq;
+                }
+                for (r = 0; r < m; r++)
+                {
+                    MATRIX_AT(A, r, p) = a_p[r];
+                    MATRIX_AT(A, r, q) = a_q[r];
+                }
+                a_p[p] = app - t * apq;
+                a_q[q] = aqq + t * apq;
+                a_p[q] = a_q[p] = 0.0;
+            }
+        }
+    }
+}
+
+void free_lowrank_affinity(LowRankAffinity *affinity)
+{
+    if (!affinity)
+    {
+        return;
+    }
+    free_matrix_memory(affinity->factor);
+    free(affinity->degrees);
+    free(affinity);
+}
+
+/* F = C * V_r * L_r^-1/2 from the kernel block C (n x m) and the landmark rows of C */
+static Matrix *nystrom_factor(const Matrix *C, const int *landmarks)
+{
+    int i, j, rank = 0, m = C->cols;
+    double largest = 0.0;
+    Matrix *M = init_matrix(m, m), *V = init_matrix(m, m), *projection = NULL, *factor = NULL;
+
+    if (M != NULL && V != NULL)
+    {
+        for (i = 0; i < m; i++)
+        {
+            memcpy(MATRIX_ROW(M, i), MATRIX_ROW(C, landmarks[i]), m * sizeof(double));
+        }
+        jacobi_eigen(M, V);
+        for (i = 0; i < m; i++)
+        {
+            largest = MATRIX_AT(M, i, i) > largest ? MATRIX_AT(M, i, i) : largest;
+        }
+        for (i = 0; i < m; i++)
+        {
+            rank += MATRIX_AT(M, i, i) > NYSTROM_EIGEN_CUTOFF * largest;
+        }
+        projection = rank > 0 ? init_matrix(m, rank) : NULL;
+    }
+    if (projection != NULL)
+    {
+        int column = 0;
+        for (j = 0; j < m; j++)
+        {
+            double eigenvalue = MATRIX_AT(M, j, j);
+            if (eigenvalue <= NYSTROM_EIGEN_CUTOFF * largest)
+            {
+                continue;
+            }
+            for (i = 0; i < m; i++)
+            {
+                MATRIX_AT(projection, i, column) = MATRIX_AT(V, j, i) / sqrt(eigenvalue);
+            }
+            column++;
+        }
+        factor = matrix_multiplication(C, projection);
+    }
+    free_matrix_memory(M);
+    free_matrix_memory(V);
+    free_matrix_memory(projection);
+    return factor;
+}
+
+LowRankAffinity *calc_nystrom_affinity(const Matrix *d_points, int landmarks, int method, unsigned long seed)
+{
+    int i, r, n = d_points->rows, m = landmarks < n ? landmarks : n;
+    uint64_t state = nystrom_seed(seed);
+    int *chosen;
+    double *column_sums;
+    Matrix *points = NULL, *C = NULL;
+    SymmetricTask task;
+    LowRankAffinity *affinity;
+
+    if (m < 1 || (affinity = (LowRankAffinity *)calloc(1, sizeof(LowRankAffinity))) == NULL)
+    {
+        return NULL;
+    }
+    affinity->size = n;
+    chosen = (int *)malloc(m * sizeof(int));
+    if (chosen == NULL || (m = choose_landmarks(d_points, m, method, &state, chosen)) == 0 ||
+        (points = init_matrix(m, d_points->cols)) == NULL || (C = init_matrix(n, m)) == NULL)
+    {
+        free(chosen);
+        free_matrix_memory(points);
+        free_matrix_memory(C);
+        free_lowrank_affinity(affinity);
+        return NULL;
+    }
+    for (i = 0; i < m; i++)
+    {
+        memcpy(MATRIX_ROW(points, i), MATRIX_ROW(d_points, chosen[i]), d_points->cols * sizeof(double));
+    }
+    memset(&task, 0, sizeof(task));
+    task.d_points = d_points;
+    task.dense = C;
+    task.tile = points;
+    parallel_run(landmark_kernel_task, &task);
+    affinity->factor = nystrom_factor(C, chosen);
+    free(chosen);
+    free_matrix_memory(points);
+    free_matrix_memory(C);
+
+    affinity->degrees = (double *)malloc((n ? n : 1) * sizeof(double));
+    column_sums = affinity->factor ? (double *)calloc(affinity->factor->cols, sizeof(double)) : NULL;
+    if (affinity->factor == NULL || affinity->degrees == NULL || column_sums == NULL)
+    {
+        free(column_sums);
+        free_lowrank_affinity(affinity);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+    {
+        for (r = 0; r < affinity->factor->cols; r++)
+        {
+            column_sums[r] += MATRIX_AT(affinity->factor, i, r);
+        }
+    }
+    /* The approximation can push a degree to or below zero; keep it positive so D^-1/2 exists */
+    for (i = 0; i < n; i++)
+    {
+        double degree = -1.0, scale;
+        for (r = 0; r < affinity->factor->cols; r++)
+        {
+            degree += MATRIX_AT(affinity->factor, i, r) * column_sums[r];
+        }
+        affinity->degrees[i] = degree > NYSTROM_MIN_DEGREE ? degree : NYSTROM_MIN_DEGREE;
+        scale = 1 / sqrt(affinity->degrees[i]);
+        for (r = 0; r < affinity->factor->cols; r++)
+        {
+            MATRIX_AT(affinity->factor, i, r) *= scale;
+        }
+    }
+    free(column_sums);
+    return affinity;
+}
+
+/* Compares the approximate affinity f_i . f_j against exp(-||x_i - x_j||^2 / 2) on `samples`
+ * random pairs i != j; returns the relative RMS error and stores the largest absolute one */
+double nystrom_sample_error(const LowRankAffinity *affinity, const Matrix *d_points, int samples, unsigned long seed,
+                            double *max_error)
+{
+    int s, r, n = d_points->rows;
+    uint64_t state = nystrom_seed(seed);
+    double squared_error = 0.0, squared_exact = 0.0, worst = 0.0;
+
+    for (s = 0; s < samples && n > 1; s++)
+    {
+        int i = (int)(nystrom_uniform(&state) * n), j = (int)(nystrom_uniform(&state) * (n - 1));
+        double exact, approximate = 0.0, error;
+        j += j >= i;
+        exact = calculate_squared_euclidean_distance(MATRIX_ROW(d_points, i), MATRIX_ROW(d_points, j), d_points->cols);
+        for (r = 0; r < affinity->factor->cols; r++)
+        {
+            approximate += MATRIX_AT(affinity->factor, i, r) * MATRIX_AT(affinity->factor, j, r);
+        }
+        approximate *= sqrt(affinity->degrees[i]) * sqrt(affinity->degrees[j]);
+        error = fabs(approximate - exact);
+        worst = error > worst ? error : worst;
+        squared_error += error * error;
+        squared_exact += exact * exact;
+    }
+    if (max_error != NULL)
+    {
+        *max_error = worst;
+    }
+    return squared_exact > 0 ? sqrt(squared_error / squared_exact) : 0.0;
+}
+
+/* mean(W) of the approximation straight from its factors: 1^T W 1 = ||G^T 1||^2 - sum_i 1 / d_i */
+double lowrank_affinity_mean(const LowRankAffinity *affinity)
+{
+    int i, r, n = affinity->size, rank = affinity->factor->cols;
+    double total = 0.0, column_sum;
+    for (r = 0; r < rank; r++)
+    {
+        column_sum = 0.0;
+        for (i = 0; i < n; i++)
+        {
+            column_sum += MATRIX_AT(affinity->factor, i, r);
+        }
+        total += column_sum * column_sum;
+    }
+    for (i = 0; i < n; i++)
+    {
+        total -= 1 / affinity->degrees[i];
+    }
+    return n > 0 ? total / ((double)n * n) : 0.0;
+}
+
+static void gram_rows_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    const Matrix *H = task->H;
+    int i, a, b, first, last, k = H->cols;
+    int threads = num_threads < task->num_partials ? num_threads : task->num_partials;
+    double *gram = task->partials + (size_t)thread_id * k * k;
+
+    if (thread_id == 0)
+    {
+        task->used_partials = threads;
+    }
+    if (thread_id >= threads)
+    {
+        return;
+    }
+    memset(gram, 0, (size_t)k * k * sizeof(double));
+    static_row_range(H->rows, thread_id, threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        const double *h_row = MATRIX_ROW(H, i);
+        for (a = 0; a < k; a++)
+        {
+            double *gram_row = gram + (size_t)a * k;
+            for (b = a; b < k; b++)
+            {
+                gram_row[b] += h_row[a] * h_row[b];
+            }
+        }
+    }
+}
+
+/* H^T * H as a parallel reduction of per-thread k x k partial sums, combined in thread order.
+ * partials holds num_partials * k * k doubles. */
+static void gram_into(const Matrix *H, Matrix *gram, double *partials, int num_partials)
+{
+    IterationTask task;
+    int t, a, b, k = H->cols;
+    memset(&task, 0, sizeof(task));
+    task.H = H;
+    task.partials = partials;
+    task.num_partials = num_partials;
+
+    parallel_run(gram_rows_task, &task);
+    for (a = 0; a < k; a++)
+    {
+        memset(MATRIX_ROW(gram, a), 0, k * sizeof(double));
+    }
+    for (t = 0; t < task.used_partials; t++)
+    {
+        const double *partial = partials + (size_t)t * k * k;
+        for (a = 0; a < k; a++)
+        {
+            for (b = a; b < k; b++)
+            {
+                MATRIX_AT(gram, a, b) += partial[a * k + b];
+            }
+        }
+    }
+    for (a = 0; a < k; a++)
+    {
+        for (b = 0; b < a; b++)
+        {
+            MATRIX_AT(gram, a, b) = MATRIX_AT(gram, b, a);
+        }
+    }
+}
+
+Matrix *calc_gram_matrix(const Matrix *H)
+{
+    int num_partials = get_num_threads(), k = H->cols;
+    double *partials;
+    Matrix *gram;
+    if ((gram = init_matrix(k, k)) == NULL)
+    {
+        return NULL;
+    }
+    if ((partials = (double *)malloc(((size_t)num_partials * k * k + 1) * sizeof(double))) == NULL)
+    {
+        free_matrix_memory(gram);
+        return NULL;
+    }
+    gram_into(H, gram, partials, num_partials);
+    free(partials);
+    return gram;
+}
+
+/* SYMM-style W*H over the stored triangle: entry (i, j) feeds row i from h_j and row j from h_i.
+ * Each thread scatters into its own n x k partial product over a fixed, cyclic set of
+ * triangular row blocks, so the result does not depend on scheduling. */
+static void packed_times_matrix_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    const PackedMatrix *W = task->packed;
+    const Matrix *H = task->H;
+    int b, i, j, c, k = H->cols;
+    int threads = num_threads < task->num_partials ? num_threads : task->num_partials;
+    double *partial = task->partials + (size_t)thread_id * W->size * k;
+
+    if (thread_id == 0)
+    {
+        task->used_partials = threads;
+    }
+    if (thread_id >= threads)
+    {
+        return;
+    }
+    memset(partial, 0, (size_t)W->size * k * sizeof(double));
+    for (b = thread_id; b < task->blocks.num_blocks; b += threads)
+    {
+        for (i = task->blocks.block_start[b]; i < task->blocks.block_start[b + 1]; i++)
+        {
+            const double *w_row = PACKED_ROW(W, i);
+            const double *h_i = MATRIX_ROW(H, i);
+            double *wh_i = partial + (size_t)i * k;
+            for (c = 0; c < k; c++)
+            {
+                wh_i[c] += w_row[i] * h_i[c];
+            }
+            for (j = i + 1; j < W->size; j++)
+            {
+                double w = w_row[j];
+                const double *h_j = MATRIX_ROW(H, j);
+                double *wh_j = partial + (size_t)j * k;
+                for (c = 0; c < k; c++)
+                {
+                    wh_i[c] += w * h_j[c];
+                    wh_j[c] += w * h_i[c];
+                }
+            }
+        }
+    }
+}
+
+/* packed_times_matrix_task over float entries; each one is widened before it is multiplied */
+static void packed_float_times_matrix_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    const PackedFloatMatrix *W = task->packed_float;
+    const Matrix *H = task->H;
+    int b, i, j, c, k = H->cols;
+    int threads = num_threads < task->num_partials ? num_threads : task->num_partials;
+    double *partial = task->partials + (size_t)thread_id * W->size * k;
+
+    if (thread_id == 0)
+    {
+        task->used_partials = threads;
+    }
+    if (thread_id >= threads)
+    {
+        return;
+    }
+    memset(partial, 0, (size_t)W->size * k * sizeof(double));
+    for (b = thread_id; b < task->blocks.num_blocks; b += threads)
+    {
+        for (i = task->blocks.block_start[b]; i < task->blocks.block_start[b + 1]; i++)
+        {
+            const float *w_row = PACKED_ROW(W, i);
+            const double *h_i = MATRIX_ROW(H, i);
+            double *wh_i = partial + (size_t)i * k;
+            for (c = 0; c < k; c++)
+            {
+                wh_i[c] += (double)w_row[i] * h_i[c];
+            }
+            for (j = i + 1; j < W->size; j++)
+            {
+                double w = w_row[j];
+                const double *h_j = MATRIX_ROW(H, j);
+                double *wh_j = partial + (size_t)j * k;
+                for (c = 0; c < k; c++)
+                {
+                    wh_i[c] += w * h_j[c];
+                    wh_j[c] += w * h_i[c];
+                }
+            }
+        }
+    }
+}
+
+static void partial_sum_rows_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    Matrix *WH = task->out;
+    int i, t, c, first, last, k = WH->cols;
+    size_t partial_size = (size_t)WH->rows * k;
+
+    static_row_range(WH->rows, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        double *wh_row = MATRIX_ROW(WH, i);
+        memcpy(wh_row, task->partials + (size_t)i * k, k * sizeof(double));
+        for (t = 1; t < task->used_partials; t++)
+        {
+            const double *partial = task->partials + t * partial_size + (size_t)i * k;
+            for (c = 0; c < k; c++)
+            {
+                wh_row[c] += partial[c];
+            }
+        }
+    }
+}
+
+/* Buffers of one SymNMF solve, sized from n and k before the first iteration so that the
+ * iterations themselves never touch the heap */
+static void free_symnmf_workspace(SymnmfWorkspace *ws)
+{
+    free_matrix_memory(ws->buffer);
+    free_matrix_memory(ws->WH);
+    free_matrix_memory(ws->gram);
+    free_matrix_memory(ws->denominator);
+    free(ws->partials);
+    free(ws->gemm_buffers);
+    free(ws->disk_buffers);
+    free_matrix_memory(ws->lowrank_temp);
+    free(ws->triangle_blocks.block_start);
+    memset(ws, 0, sizeof(*ws));
+}
+
+static int init_symnmf_workspace(SymnmfWorkspace *ws, const Affinity *W, int k)
+{
+    int n = W->size;
+    size_t partial_size = (size_t)k * k;
+    void *gemm_buffers = NULL;
+
+    memset(ws, 0, sizeof(*ws));
+    ws->num_partials = get_num_threads();
+    if ((W->kind == AFFINITY_PACKED || W->kind == AFFINITY_PACKED_FLOAT) && (size_t)n * k > partial_size)
+    {
+        partial_size = (size_t)n * k;
+    }
+    if (W->kind == AFFINITY_DISK)
+    {
+        /* Only as many n x k partials as the memory budget holds, at least one */
+        size_t fit = W->disk->partial_capacity / ((size_t)n * k > 0 ? (size_t)n * k : 1);
+        if (fit == 0)
+        {
+            return 1;
+        }
+        ws->disk_partials = fit < (size_t)ws->num_partials ? (int)fit : ws->num_partials;
+        if ((size_t)ws->disk_partials * n * k > (size_t)ws->num_partials * partial_size)
+        {
+            partial_size = ((size_t)ws->disk_partials * n * k + ws->num_partials - 1) / ws->num_partials;
+        }
+    }
+    ws->gemm_buffer_size = gemm_buffer_size(k);
+    ws->buffer = init_matrix(n, k);
+    ws->WH = init_matrix(n, k);
+    ws->gram = init_matrix(k, k);
+    ws->denominator = init_matrix(n, k);
+    ws->partials = (double *)malloc(((size_t)ws->num_partials * partial_size + 1) * sizeof(double));
+    if ((W->kind == AFFINITY_DISK && (ws->disk_buffers = (double *)malloc(2 * W->disk->band_capacity * sizeof(double))) == NULL) ||
+        (W->kind == AFFINITY_LOWRANK && (ws->lowrank_temp = init_matrix(W->lowrank->factor->cols, k)) == NULL))
+    {
+        free_symnmf_workspace(ws);
+        return 1;
+    }
+    if (posix_memalign(&gemm_buffers, MATRIX_ALIGNMENT, (size_t)ws->num_partials * ws->gemm_buffer_size * sizeof(double)) == 0)
+    {
+        ws->gemm_buffers = (double *)gemm_buffers;
+    }
+    if (ws->buffer == NULL || ws->WH == NULL || ws->gram == NULL || ws->denominator == NULL ||
+        ws->partials == NULL || ws->gemm_buffers == NULL ||
+        init_row_blocks(&ws->triangle_blocks, n, 1) != 0)
+    {
+        free_symnmf_workspace(ws);
+        return 1;
+    }
+    return 0;
+}
+
+static void packed_times_matrix(const Affinity *W, const Matrix *H, Matrix *WH, SymnmfWorkspace *ws)
+{
+    IterationTask task;
+    memset(&task, 0, sizeof(task));
+    task.packed = W->packed;
+    task.packed_float = W->packed_float;
+    task.H = H;
+    task.out = WH;
+    task.partials = ws->partials;
+    task.num_partials = ws->num_partials;
+    task.blocks = ws->triangle_blocks;
+
+    parallel_run(W->kind == AFFINITY_PACKED_FLOAT ? packed_float_times_matrix_task : packed_times_matrix_task, &task);
+    parallel_run(partial_sum_rows_task, &task);
+}
+
+/* W*H with every row of W read straight from its CSR entries; the rows are independent */
+static void sparse_times_matrix_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    const SparseMatrix *W = task->sparse;
+    int i, c, first, last, k = task->H->cols;
+    size_t e;
+
+    static_row_range(W->size, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        double *wh_row = MATRIX_ROW(task->out, i);
+        memset(wh_row, 0, k * sizeof(double));
+        for (e = W->row_start[i]; e < W->row_start[i + 1]; e++)
+        {
+            double w = W->values[e];
+            const double *h_row = MATRIX_ROW(task->H, W->cols[e]);
+            for (c = 0; c < k; c++)
+            {
+                wh_row[c] += w * h_row[c];
+            }
+        }
+    }
+}
+
+/* Matrix-free W*H: each thread rebuilds its rows of W one DISTANCE_BLOCK tile at a time from the
+ * points (distances, Gaussian kernel, degree scaling) and folds every tile into WH at once.
+ * Rows are recomputed in full rather than mirrored, so nothing but the tile is ever stored. */
+static void implicit_times_matrix_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    const Matrix *d_points = task->implicit->d_points;
+    const double *inv_sqrt = task->implicit->inv_sqrt_degrees;
+    int i, j, j0, c, first, last, n = d_points->rows, k = task->H->cols;
+    double tile[DISTANCE_BLOCK];
+
+    static_row_range(n, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        const double *point = MATRIX_ROW(d_points, i);
+        double *wh_row = MATRIX_ROW(task->out, i);
+        memset(wh_row, 0, k * sizeof(double));
+        for (j0 = 0; j0 < n; j0 += DISTANCE_BLOCK)
+        {
+            int j1 = (n - j0 < DISTANCE_BLOCK) ? n : j0 + DISTANCE_BLOCK;
+            squared_distances_to_points(point, d_points, j0, j1, tile);
+            gaussian_affinity_block(tile, j1 - j0);
+            for (j = j0; j < j1; j++)
+            {
+                const double *h_row = MATRIX_ROW(task->H, j);
+                double w = (i < j) ? (inv_sqrt[i] * tile[j - j0]) * inv_sqrt[j] : (inv_sqrt[j] * tile[j - j0]) * inv_sqrt[i];
+                if (j == i)
+                {
+                    continue;
+                }
+                for (c = 0; c < k; c++)
+                {
+                    wh_row[c] += w * h_row[c];
+                }
+            }
+        }
+    }
+}
+
+/* Out-of-core W. The file holds a DISK_HEADER_BYTES header (magic and size) followed by the
+ * packed upper triangle of W, row after row. Rows are grouped into bands of at most
+ * band_capacity doubles so that two bands fit in half the memory budget: while the pool
+ * multiplies one band, a reader thread fills the other. The other half holds the per-thread
+ * n x k partial sums of the product, so a product runs on fewer threads when the budget is tight. */
+
+static double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Full-length pread/pwrite; return 0 once every byte has been transferred */
+static int disk_transfer(int fd, void *buffer, size_t bytes, off_t offset, int writing)
+{
+    char *cursor = (char *)buffer;
+    while (bytes > 0)
+    {
+        ssize_t done = writing ? pwrite(fd, cursor, bytes, offset) : pread(fd, cursor, bytes, offset);
+        if (done <= 0)
+        {
+            return 1;
+        }
+        cursor += done;
+        bytes -= (size_t)done;
+        offset += done;
+    }
+    return 0;
+}
+
+/* Position of entry (i, i) in the packed triangle of a size x size matrix */
+static size_t packed_diagonal(int size, int i)
+{
+    return PACKED_OFFSET(size, i) + (size_t)i;
+}
+
+static size_t band_doubles(const DiskAffinity *disk, int band)
+{
+    return packed_diagonal(disk->size, disk->band_start[band + 1]) - packed_diagonal(disk->size, disk->band_start[band]);
+}
+
+static off_t band_offset(const DiskAffinity *disk, int band)
+{
+    return (off_t)DISK_HEADER_BYTES + (off_t)(packed_diagonal(disk->size, disk->band_start[band]) * sizeof(double));
+}
+
+/* Normalized rows of one band, with the scaling of normalize_packed_similarity_matrix */
+static void disk_band_rows_task(void *arg, int thread_id, int num_threads)
+{
+    DiskTask *task = (DiskTask *)arg;
+    const Matrix *d_points = task->d_points;
+    const double *inv_sqrt = task->inv_sqrt;
+    int i, j, first, last, n = d_points->rows;
+    size_t base = packed_diagonal(n, task->first_row);
+    double sum = 0.0;
+
+    static_row_range(task->last_row - task->first_row, thread_id, num_threads, &first, &last);
+    for (i = task->first_row + first; i < task->first_row + last; i++)
+    {
+        double *row = task->band + (packed_diagonal(n, i) - base);
+        row[0] = 0;
+        squared_distances_to_points(MATRIX_ROW(d_points, i), d_points, i + 1, n, row + 1);
+        gaussian_affinity_block(row + 1, n - i - 1);
+        for (j = i + 1; j < n; j++)
+        {
+            row[j - i] = (inv_sqrt[i] * row[j - i]) * inv_sqrt[j];
+            sum += row[j - i];
+        }
+    }
+    task->sums[thread_id] = sum;
+}
+
+DiskAffinity *write_disk_affinity(const Matrix *d_points, const char *path, size_t memory_budget)
+{
+    DiskAffinity *disk;
+    DiskTask task;
+    char header[DISK_HEADER_BYTES];
+    double *degrees, sums[MAX_THREADS], started = monotonic_seconds();
+    int i, t, b, n = d_points->rows, failed = 0;
+    size_t rows_doubles;
+
+    if ((disk = (DiskAffinity *)calloc(1, sizeof(DiskAffinity))) == NULL)
+    {
+        return NULL;
+    }
+    disk->size = n;
+    disk->band_capacity = memory_budget / 4 / sizeof(double);
+    disk->partial_capacity = memory_budget / 2 / sizeof(double);
+    if (disk->band_capacity < (size_t)(n > 0 ? n : 1))
+    {
+        /* a band must hold at least the longest row */
+        free(disk);
+        return NULL;
+    }
+    disk->band_start = (int *)malloc(((size_t)n + 2) * sizeof(int));
+    disk->stats = (DiskStats *)calloc(1, sizeof(DiskStats));
+    disk->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    degrees = calc_degree_vector(d_points);
+    memset(&task, 0, sizeof(task));
+    task.band = (double *)malloc(disk->band_capacity * sizeof(double));
+    if (disk->band_start == NULL || disk->stats == NULL || disk->fd < 0 || degrees == NULL || task.band == NULL)
+    {
+        free(degrees);
+        free(task.band);
+        free_disk_affinity(disk);
+        return NULL;
+    }
+
+    disk->band_start[0] = 0;
+    for (i = 0, b = 0; i < n; b++)
+    {
+        for (rows_doubles = 0; i < n && rows_doubles + (size_t)(n - i) <= disk->band_capacity; i++)
+        {
+            rows_doubles += (size_t)(n - i);
+        }
+        disk->band_start[b + 1] = i;
+    }
+    disk->num_bands = b;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, DISK_MAGIC, sizeof(DISK_MAGIC) - 1);
+    memcpy(header + 8, &n, sizeof(n));
+    failed = disk_transfer(disk->fd, header, sizeof(header), 0, 1);
+
+    for (i = 0; i < n; ++i)
+    {
+        degrees[i] = 1 / sqrt(degrees[i]);
+    }
+    task.d_points = d_points;
+    task.inv_sqrt = degrees;
+    task.sums = sums;
+    for (b = 0; b < disk->num_bands && !failed; b++)
+    {
+        task.first_row = disk->band_start[b];
+        task.last_row = disk->band_start[b + 1];
+        memset(sums, 0, sizeof(sums));
+        parallel_run(disk_band_rows_task, &task);
+        for (t = 0; t < MAX_THREADS; t++)
+        {
+            disk->total += 2 * sums[t];
+        }
+        failed = disk_transfer(disk->fd, task.band, band_doubles(disk, b) * sizeof(double), band_offset(disk, b), 1);
+        disk->stats->bytes_written += (double)band_doubles(disk, b) * sizeof(double);
+    }
+    free(degrees);
+    free(task.band);
+    if (failed)
+    {
+        free_disk_affinity(disk);
+        return NULL;
+    }
+    disk->stats->write_seconds = monotonic_seconds() - started;
+    return disk;
+}
+
+void free_disk_affinity(DiskAffinity *disk)
+{
+    if (!disk)
+    {
+        return;
+    }
+    if (disk->fd >= 0)
+    {
+        close(disk->fd);
+    }
+    free(disk->band_start);
+    free(disk->stats);
+    free(disk);
+}
+
+/* Read-ahead thread: fills the two band slots in turn, each once the multiply has released it */
+static void *disk_reader(void *arg)
+{
+    DiskStream *stream = (DiskStream *)arg;
+    const DiskAffinity *disk = stream->disk;
+    int b, slot, stop, failed = 0;
+    for (b = 0; b < disk->num_bands && !failed; b++)
+    {
+        double started;
+        slot = b % 2;
+        pthread_mutex_lock(&stream->lock);
+        while (stream->filled[slot] && !stream->stop)
+        {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        stop = stream->stop;
+        pthread_mutex_unlock(&stream->lock);
+        if (stop)
+        {
+            break;
+        }
+        started = monotonic_seconds();
+        failed = disk_transfer(disk->fd, stream->buffers[slot], band_doubles(disk, b) * sizeof(double),
+                               band_offset(disk, b), 0);
+        stream->io_seconds += monotonic_seconds() - started;
+        pthread_mutex_lock(&stream->lock);
+        stream->filled[slot] = 1;
+        stream->failed = failed;
+        pthread_cond_broadcast(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+    }
+    return NULL;
+}
+
+/* SYMM-style product of one band, as packed_times_matrix_task does for the whole triangle */
+static void disk_band_product_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    const DiskAffinity *disk = task->disk;
+    const Matrix *H = task->H;
+    int i, j, c, k = H->cols, n = disk->size;
+    int threads = num_threads < task->num_partials ? num_threads : task->num_partials;
+    size_t base = packed_diagonal(n, task->band_first);
+    double *partial = task->partials + (size_t)thread_id * n * k;
+
+    if (thread_id == 0 && threads > task->used_partials)
+    {
+        task->used_partials = threads;
+    }
+    if (thread_id >= threads)
+    {
+        return;
+    }
+    for (i = task->band_first; i < task->band_last; i++)
+    {
+        const double *w_row = task->band + (packed_diagonal(n, i) - base);
+        const double *h_i = MATRIX_ROW(H, i);
+        double *wh_i = partial + (size_t)i * k;
+        if ((i / DISK_ROW_CHUNK) % threads != thread_id)
+        {
+            continue;
+        }
+        for (j = i + 1; j < n; j++)
+        {
+            double w = w_row[j - i];
+            const double *h_j = MATRIX_ROW(H, j);
+            double *wh_j = partial + (size_t)j * k;
+            for (c = 0; c < k; c++)
+            {
+                wh_i[c] += w * h_j[c];
+                wh_j[c] += w * h_i[c];
+            }
+        }
+    }
+}
+
+static int disk_times_matrix(const DiskAffinity *disk, const Matrix *H, Matrix *WH, SymnmfWorkspace *ws)
+{
+    DiskStream stream;
+    IterationTask task;
+    pthread_t reader;
+    int b, slot, threads = ws->disk_partials, failed = 0;
+    double started = monotonic_seconds();
+
+    memset(&stream, 0, sizeof(stream));
+    stream.disk = disk;
+    stream.buffers[0] = ws->disk_buffers;
+    stream.buffers[1] = ws->disk_buffers + disk->band_capacity;
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+    memset(ws->partials, 0, (size_t)threads * disk->size * H->cols * sizeof(double));
+    memset(&task, 0, sizeof(task));
+    task.disk = disk;
+    task.H = H;
+    task.out = WH;
+    task.partials = ws->partials;
+    task.num_partials = threads;
+    if (pthread_create(&reader, NULL, disk_reader, &stream) != 0)
+    {
+        pthread_mutex_destroy(&stream.lock);
+        pthread_cond_destroy(&stream.changed);
+        return 1;
+    }
+
+    for (b = 0; b < disk->num_bands && !failed; b++)
+    {
+        slot = b % 2;
+        pthread_mutex_lock(&stream.lock);
+        while (!stream.filled[slot] && !stream.failed)
+        {
+            pthread_cond_wait(&stream.changed, &stream.lock);
+        }
+        failed = stream.failed;
+        pthread_mutex_unlock(&stream.lock);
+        if (failed)
+        {
+            break;
+        }
+        task.band = stream.buffers[slot];
+        task.band_first = disk->band_start[b];
+        task.band_last = disk->band_start[b + 1];
+        parallel_run(disk_band_product_task, &task);
+        pthread_mutex_lock(&stream.lock);
+        stream.filled[slot] = 0;
+        pthread_cond_broadcast(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+    }
+
+    pthread_mutex_lock(&stream.lock);
+    stream.stop = 1;
+    pthread_cond_broadcast(&stream.changed);
+    pthread_mutex_unlock(&stream.lock);
+    pthread_join(reader, NULL);
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.changed);
+    if (failed)
+    {
+        return 1;
+    }
+
+    parallel_run(partial_sum_rows_task, &task);
+    disk->stats->bytes_read += (double)packed_diagonal(disk->size, disk->size) * sizeof(double);
+    disk->stats->io_seconds += stream.io_seconds;
+    disk->stats->stream_seconds += monotonic_seconds() - started;
+    disk->stats->passes++;
+    return 0;
+}
+
+/* Seeds W*H with the -D^-1 * H correction of a low-rank W before G * (G^T * H) is added */
+static void lowrank_diagonal_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    int i, c, first, last, k = task->H->cols;
+
+    static_row_range(task->H->rows, thread_id, num_threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        const double *h_i = MATRIX_ROW(task->H, i);
+        double *out_i = MATRIX_ROW(task->out, i), scale = -1 / task->lowrank->degrees[i];
+        for (c = 0; c < k; c++)
+        {
+            out_i[c] = scale * h_i[c];
+        }
+    }
+}
+
+static int affinity_times_matrix_into(const Affinity *W, const Matrix *H, Matrix *WH, SymnmfWorkspace *ws)
+{
+    IterationTask task;
+    if (H->rows != W->size || WH->rows != W->size || WH->cols != H->cols)
+    {
+        return 1;
+    }
+    switch (W->kind)
+    {
+    case AFFINITY_DENSE:
+        return gemm_buffered(0, 0, W->dense, H, WH, 0, ws->gemm_buffers, ws->gemm_buffer_size, ws->num_partials);
+    case AFFINITY_PACKED:
+    case AFFINITY_PACKED_FLOAT:
+        packed_times_matrix(W, H, WH, ws);
+        return 0;
+    case AFFINITY_SPARSE:
+        memset(&task, 0, sizeof(task));
+        task.sparse = W->sparse;
+        task.H = H;
+        task.out = WH;
+        parallel_run(sparse_times_matrix_task, &task);
+        return 0;
+    case AFFINITY_IMPLICIT:
+        memset(&task, 0, sizeof(task));
+        task.implicit = W->implicit;
+        task.H = H;
+        task.out = WH;
+        parallel_run(implicit_times_matrix_task, &task);
+        return 0;
+    case AFFINITY_DISK:
+        return disk_times_matrix(W->disk, H, WH, ws);
+    case AFFINITY_LOWRANK:
+        memset(&task, 0, sizeof(task));
+        task.lowrank = W->lowrank;
+        task.H = H;
+        task.out = WH;
+        parallel_run(lowrank_diagonal_task, &task);
+        return gemm_buffered(1, 0, W->lowrank->factor, H, ws->lowrank_temp, 0, ws->gemm_buffers, ws->gemm_buffer_size,
+                             ws->num_partials) ||
+               gemm_buffered(0, 0, W->lowrank->factor, ws->lowrank_temp, WH, 1, ws->gemm_buffers, ws->gemm_buffer_size,
+                             ws->num_partials);
+    default:
+        return 1;
+    }
+}
+
+int affinity_times_matrix(const Affinity *W, const Matrix *H, Matrix *WH)
+{
+    SymnmfWorkspace ws;
+    int failed;
+    if (H->rows != W->size || init_symnmf_workspace(&ws, W, H->cols) != 0)
+    {
+        return 1;
+    }
+    failed = affinity_times_matrix_into(W, H, WH, &ws);
+    free_symnmf_workspace(&ws);
+    return failed;
+}
+
+/* The damped multiplicative update of a contiguous share of rows, fused with the squared
+ * Frobenius norm of next_h - H over the same rows. The norm is kept in DELTA_LANES independent
+ * sums (entry j feeds lane j % DELTA_LANES) so the loop vectorizes without reassociation. */
+static void update_rows_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    int i, j, l, first, last, k = task->H->cols;
+    int threads = num_threads < task->num_partials ? num_threads : task->num_partials;
+    double lanes[DELTA_LANES], delta = 0.0;
+
+    if (thread_id == 0)
+    {
+        task->used_partials = threads;
+    }
+    if (thread_id >= threads)
+    {
+        return;
+    }
+    for (l = 0; l < DELTA_LANES; l++)
+    {
+        lanes[l] = 0.0;
+    }
+    static_row_range(task->H->rows, thread_id, threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        const double *h_row = MATRIX_ROW(task->H, i);
+        const double *wh_row = MATRIX_ROW(task->WH, i);
+        const double *denominator_row = MATRIX_ROW(task->denominator, i);
+        double *next_row = MATRIX_ROW(task->out, i);
+        for (j = 0; j + DELTA_LANES <= k; j += DELTA_LANES)
+        {
+            for (l = 0; l < DELTA_LANES; l++)
+            {
+                double next = h_row[j + l] * (BETA * (wh_row[j + l] / denominator_row[j + l]) + (1 - BETA));
+                double diff = next - h_row[j + l];
+                next_row[j + l] = next;
+                lanes[l] += diff * diff;
+            }
+        }
+        for (; j < k; j++)
+        {
+            double next = h_row[j] * (BETA * (wh_row[j] / denominator_row[j]) + (1 - BETA));
+            double diff = next - h_row[j];
+            next_row[j] = next;
+            lanes[j % DELTA_LANES] += diff * diff;
+        }
+    }
+    for (l = 0; l < DELTA_LANES; l++)
+    {
+        delta += lanes[l];
+    }
+    task->partials[thread_id] = delta;
+}
+
+/* One multiplicative update from H into next_h, which must not alias H; *delta receives
+ * ||next_h - H||_F^2. The denominator (H*H^T)*H is evaluated as H*(H^T*H): a k x k temporary
+ * and O(n*k^2) work. */
+static int next_h_into(const Affinity *W, const Matrix *H, Matrix *next_h, SymnmfWorkspace *ws, double *delta)
+{
+    IterationTask task;
+    double partials[MAX_THREADS];
+    int t;
+    if (affinity_times_matrix_into(W, H, ws->WH, ws) != 0)
+    {
+        return 1;
+    }
+    gram_into(H, ws->gram, ws->partials, ws->num_partials);
+    if (gemm_buffered(0, 0, H, ws->gram, ws->denominator, 0, ws->gemm_buffers, ws->gemm_buffer_size, ws->num_partials) != 0)
+    {
+        return 1;
+    }
+
+    memset(&task, 0, sizeof(task));
+    task.H = H;
+    task.WH = ws->WH;
+    task.denominator = ws->denominator;
+    task.out = next_h;
+    task.partials = partials;
+    task.num_partials = MAX_THREADS;
+    parallel_run(update_rows_task, &task);
+    *delta = 0.0;
+    for (t = 0; t < task.used_partials; t++)
+    {
+        *delta += partials[t];
+    }
+    return 0;
+}
+
+Matrix *get_next_H_matrix(const Affinity *W, const Matrix *H)
+{
+    SymnmfWorkspace ws;
+    Matrix *next_h;
+    double delta;
+    if (H->rows != W->size || init_symnmf_workspace(&ws, W, H->cols) != 0)
+    {
+        return NULL;
+    }
+    if (next_h_into(W, H, ws.buffer, &ws, &delta) != 0)
+    {
+        free_symnmf_workspace(&ws);
+        return NULL;
+    }
+    next_h = ws.buffer;
+    ws.buffer = NULL;
+    free_symnmf_workspace(&ws);
+    return next_h;
+}
+
+static void delta_norm_task(void *arg, int thread_id, int num_threads)
+{
+    IterationTask *task = (IterationTask *)arg;
+    int i, j, first, last;
+    int threads = num_threads < task->num_partials ? num_threads : task->num_partials;
+    double norm = 0.0;
+
+    if (thread_id == 0)
+    {
+        task->used_partials = threads;
+    }
+    if (thread_id >= threads)
+    {
+        return;
+    }
+    static_row_range(task->H->rows, thread_id, threads, &first, &last);
+    for (i = first; i < last; i++)
+    {
+        const double *h_row = MATRIX_ROW(task->H, i);
+        const double *next_row = MATRIX_ROW(task->next_h, i);
+        for (j = 0; j < task->H->cols; j++)
+        {
+            double diff = next_row[j] - h_row[j];
+            norm += diff * diff;
+        }
+    }
+    task->partials[thread_id] = norm;
+}
+
+int has_converged(const Matrix *H, const Matrix *next_h)
+{
+    IterationTask task;
+    int t;
+    double norm = 0.0;
+    double partials[MAX_THREADS];
+
+    memset(&task, 0, sizeof(task));
+    task.H = H;
+    task.next_h = next_h;
+    task.partials = partials;
+    task.num_partials = MAX_THREADS;
+    parallel_run(delta_norm_task, &task);
+    for (t = 0; t < task.used_partials; t++)
+    {
+        norm += partials[t];
+    }
+
+    return (norm < EPSILON);
+}
+
+/* Iterates between the caller's H and one workspace buffer by swapping pointers; the result is
+ * always returned in the workspace buffer, which the caller owns. H is overwritten. */
+Matrix *calc_symnmf_affinity(const Affinity *W, Matrix *H)
+{
+    SymnmfWorkspace ws;
+    int i, failed;
+    double delta;
+    Matrix *curr_h, *next_h, *temp;
+    if (H->rows != W->size || init_symnmf_workspace(&ws, W, H->cols) != 0)
+    {
+        return NULL;
+    }
+    curr_h = H;
+    next_h = ws.buffer;
+    failed = next_h_into(W, curr_h, next_h, &ws, &delta);
+
+    for (i = 0; i < MAX_ITER && !failed && delta >= EPSILON; i++)
+    {
+        temp = curr_h;
+        curr_h = next_h;
+        next_h = temp;
+        failed = next_h_into(W, curr_h, next_h, &ws, &delta);
+    }
+
+    if (failed)
+    {
+        free_symnmf_workspace(&ws);
+        return NULL;
+    }
+    if (next_h == H)
+    {
+        make_a_copy(ws.buffer, H);
+    }
+    next_h = ws.buffer;
+    ws.buffer = NULL;
+    free_symnmf_workspace(&ws);
+    return next_h;
+}
+
+/* Sets up W of the given kind with every storage pointer NULL; the caller sets the one it uses */
+static void init_affinity(Affinity *W, int kind, int size)
+{
+    W->kind = kind;
+    W->size = size;
+    W->dense = NULL;
+    W->packed = NULL;
+    W->sparse = NULL;
+    W->implicit = NULL;
+    W->disk = NULL;
+    W->lowrank = NULL;
+    W->packed_float = NULL;
+}
+
+/* Scales a unit H0 ~ U(0, 1) into U(0, 2 * sqrt(mean(W) / k)), the initialization symnmf.py draws
+ * for a dense W. An approximate W can have a negative mean, which counts as 0. */
+void scale_initial_h(Matrix *H, double mean, int k)
+{
+    int i, j;
+    double scale = 2 * sqrt((mean > 0 ? mean : 0) / k);
+    for (i = 0; i < H->rows; i++)
+    {
+        double *row = MATRIX_ROW(H, i);
+        for (j = 0; j < H->cols; j++)
+        {
+            row[j] *= scale;
+        }
+    }
+}
+
+Matrix *calc_symnmf(const Matrix *norm_matrix, Matrix *H)
+{
+    Affinity W;
+    init_affinity(&W, AFFINITY_DENSE, norm_matrix->rows);
+    W.dense = norm_matrix;
+    return calc_symnmf_affinity(&W, H);
+}
+
+Matrix *calc_symnmf_packed(const PackedMatrix *norm_matrix, Matrix *H)
+{
+    Affinity W;
+    init_affinity(&W, AFFINITY_PACKED, norm_matrix->size);
+    W.packed = norm_matrix;
+    return calc_symnmf_affinity(&W, H);
+}
+
+Matrix *calc_symnmf_sparse(const SparseMatrix *norm_matrix, Matrix *H)
+{
+    Affinity W;
+    init_affinity(&W, AFFINITY_SPARSE, norm_matrix->size);
+    W.sparse = norm_matrix;
+    return calc_symnmf_affinity(&W, H);
+}
+
+Matrix *calc_symnmf_implicit(const ImplicitAffinity *norm_matrix, Matrix *H)
+{
+    Affinity W;
+    init_affinity(&W, AFFINITY_IMPLICIT, norm_matrix->d_points->rows);
+    W.implicit = norm_matrix;
+    return calc_symnmf_affinity(&W, H);
+}
+
+/* The achieved read bandwidth is left in norm_matrix->stats */
+Matrix *calc_symnmf_disk(const DiskAffinity *norm_matrix, Matrix *H)
+{
+    Affinity W;
+    init_affinity(&W, AFFINITY_DISK, norm_matrix->size);
+    W.disk = norm_matrix;
+    return calc_symnmf_affinity(&W, H);
+}
+
+Matrix *calc_symnmf_lowrank(const LowRankAffinity *norm_matrix, Matrix *H)
+{
+    Affinity W;
+    init_affinity(&W, AFFINITY_LOWRANK, norm_matrix->size);
+    W.lowrank = norm_matrix;
+    return calc_symnmf_affinity(&W, H);
+}
+
+Matrix *calc_symnmf_packed_float(const PackedFloatMatrix *norm_matrix, Matrix *H)
+{
+    Affinity W;
+    init_affinity(&W, AFFINITY_PACKED_FLOAT, norm_matrix->size);
+    W.packed_float = norm_matrix;
+    return calc_symnmf_affinity(&W, H);
+}
+
+/* numpy's legacy generator: MT19937 seeded with init_genrand, doubles from 53 random bits */
+static void mt_seed(MersenneTwister *mt, unsigned long seed)
+{
+    int i;
+    mt->state[0] = (uint32_t)seed;
+    for (i = 1; i < MT_STATE_SIZE; i++)
+    {
+        mt->state[i] = (uint32_t)(1812433253UL * (mt->state[i - 1] ^ (mt->state[i - 1] >> 30)) + (unsigned long)i);
+    }
+    mt->next = MT_STATE_SIZE;
+}
+
+static uint32_t mt_next(MersenneTwister *mt)
+{
+    uint32_t y;
+    int i;
+    if (mt->next >= MT_STATE_SIZE)
+    {
+        for (i = 0; i < MT_STATE_SIZE; i++)
+        {
+            y = (mt->state[i] & 0x80000000UL) | (mt->state[(i + 1) % MT_STATE_SIZE] & 0x7fffffffUL);
+            mt->state[i] = mt->state[(i + MT_SHIFT) % MT_STATE_SIZE] ^ (y >> 1) ^ ((y & 1) ? 0x9908b0dfUL : 0UL);
+        }
+        mt->next = 0;
+    }
+    y = mt->state[mt->next++];
+    y ^= y >> 11;
+    y ^= (y << 7) & 0x9d2c5680UL;
+    y ^= (y << 15) & 0xefc60000UL;
+    y ^= y >> 18;
+    return y;
+}
+
+static double mt_uniform(MersenneTwister *mt)
+{
+    uint32_t a = mt_next(mt) >> 5, b = mt_next(mt) >> 6;
+    return ((double)a * 67108864.0 + (double)b) / 9007199254740992.0;
+}
+
+/* The initial H ~ U(0, 2 * sqrt(mean(W) / k)), drawn row by row exactly as
+ * numpy.random.seed(seed); numpy.random.uniform(0, high, size=(n, k)) draws it */
+Matrix *init_symnmf_h(int n, int k, double mean_w, unsigned long seed)
+{
+    MersenneTwister *mt;
+    Matrix *H;
+    double high;
+    int i, j;
+
+    if (k <= 0 || mean_w < 0 || (mt = (MersenneTwister *)malloc(sizeof(MersenneTwister))) == NULL)
+    {
+        return NULL;
+    }
+    if ((H = init_matrix(n, k)) != NULL)
+    {
+        high = 2 * sqrt(mean_w / k);
+        mt_seed(mt, seed);
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; j < k; j++)
+            {
+                MATRIX_AT(H, i, j) = 0.0 + high * mt_uniform(mt);
+            }
+        }
+    }
+    free(mt);
+    return H;
+}
+
+/* Points to the SymNMF factor in one call: the packed normalized W (in float under
+ * PRECISION_MIXED), its mean, the seeded initial H and the solve. W never leaves this function. */
+Matrix *fit_symnmf(const Matrix *d_points, int k, unsigned long seed)
+{
+    PackedMatrix *packed = NULL;
+    PackedFloatMatrix *packed_float = NULL;
+    Matrix *H, *result = NULL;
+    double total = 0.0, row;
+    int i, j, n = d_points->rows;
+
+    if (get_precision() == PRECISION_MIXED)
+    {
+        packed_float = calc_packed_float_normalized_similarity_matrix(d_points);
+    }
+    else
+    {
+        packed = calc_packed_normalized_similarity_matrix(d_points);
+    }
+    if (!packed && !packed_float)
+    {
+        return NULL;
+    }
+
+    /* Off-diagonal entries count twice in the full matrix */
+    for (i = 0; i < n; i++)
+    {
+        row = 0.0;
+        if (packed)
+        {
+            const double *w_row = PACKED_ROW(packed, i);
+            for (j = i + 1; j < n; j++)
+            {
+                row += w_row[j];
+            }
+            total += 2 * row + w_row[i];
+        }
+        else
+        {
+            const float *w_row = PACKED_ROW(packed_float, i);
+            for (j = i + 1; j < n; j++)
+            {
+                row += w_row[j];
+            }
+            total += 2 * row + w_row[i];
+        }
+    }
+
+    if ((H = init_symnmf_h(n, k, n ? total / ((double)n * n) : 0.0, seed)) != NULL)
+    {
+        result = packed ? calc_symnmf_packed(packed, H) : calc_symnmf_packed_float(packed_float, H);
+    }
+    free_matrix_memory(H);
+    free_packed_matrix(packed);
+    free_packed_float_matrix(packed_float);
+    return result;
+}
+
+/* The column of the largest entry in every row of H: the cluster of each point */
+void calc_labels(const Matrix *H, int *labels)
+{
+    int i, j;
+    for (i = 0; i < H->rows; i++)
+    {
+        const double *h_row = MATRIX_ROW(H, i);
+        labels[i] = 0;
+        for (j = 1; j < H->cols; j++)
+        {
+            if (h_row[j] > h_row[labels[i]])
+            {
+                labels[i] = j;
+            }
+        }
+    }
+}
+
+double sum_vector_coordinates(const double *v1, int vec_dim)
+{
+    int i;
+    double sum = 0.0;
+    for (i = 0; i < vec_dim; i++)
+    {
+        sum += v1[i];
+    }
+    return sum;
+}
+
+double calculate_squared_euclidean_distance(const double *v1, const double *v2, int vec_dim)
+{
+    double affinity = squared_euclidean_distance(v1, v2, vec_dim);
+    gaussian_affinity_block(&affinity, 1);
+    return affinity;
+}
+
+/* Parallel CSV reader. The file is mapped once and cut into one newline-aligned chunk per
+ * thread; every thread parses its rows into a private buffer, counting them as it goes, and the
+ * buffers are then copied into the matrix at their row offsets. The column count comes from the
+ * first line, blank lines are skipped, short rows are padded with zeros and extra fields are
+ * ignored, as the strtok reader did. An empty field (",,") fails the whole read: strtok dropped
+ * it silently and shifted the rest of the row. */
+
+/* Exact powers of ten; with a mantissa below 2^53, m * 10^e and m / 10^e round only once */
+static const double CSV_POWERS[CSV_MAX_EXACT_POWER + 1] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                                           1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static locale_t csv_locale = (locale_t)0;
+static pthread_once_t csv_locale_once = PTHREAD_ONCE_INIT;
+
+static void create_csv_locale(void)
+{
+    csv_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+
+/* strtod on a copy of [p, end), for every field the fast path cannot round exactly. It runs in
+ * the C locale, so a caller's LC_NUMERIC (a ',' decimal point) cannot change the result. */
+static double csv_strtod(const char *p, const char *end)
+{
+    char local[CSV_MAX_TOKEN], *copy = local;
+    size_t length = (size_t)(end - p);
+    double value;
+    if (length >= sizeof(local) && (copy = (char *)malloc(length + 1)) == NULL)
+    {
+        return 0.0;
+    }
+    memcpy(copy, p, length);
+    copy[length] = '\0';
+    pthread_once(&csv_locale_once, create_csv_locale);
+    value = csv_locale != (locale_t)0 ? strtod_l(copy, NULL, csv_locale) : strtod(copy, NULL);
+    if (copy != local)
+    {
+        free(copy);
+    }
+    return value;
+}
+
+/* Parses one field starting at p on a line ending at end, storing its value and returning the
+ * position of the ',' (or end) that closes it, or NULL for an empty field. A decimal mantissa
+ * with up to 19 significant digits and a decimal exponent within +-22 is converted directly
+ * (Clinger's fast path, correctly rounded); any other field is handed to strtod. */
+static const char *csv_parse_field(const char *p, const char *end, double *value)
+{
+    const char *start = p;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0, negative = 0, any = 0, exact;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    if (p == end || *p == ',' || *p == '\r')
+    {
+        return NULL;
+    }
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p++ == '-';
+    }
+    for (; p < end && (unsigned)(*p - '0') < 10; p++, any = 1)
+    {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        digits += mantissa != 0;
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && (unsigned)(*p - '0') < 10; p++, any = 1)
+        {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits += mantissa != 0;
+            exponent--;
+        }
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E'))
+    {
+        int sign = 1, power = 0;
+        const char *digit = p + 1;
+        if (digit < end && (*digit == '-' || *digit == '+'))
+        {
+            sign = *digit++ == '-' ? -1 : 1;
+        }
+        any = digit < end && (unsigned)(*digit - '0') < 10;
+        for (; digit < end && (unsigned)(*digit - '0') < 10; digit++)
+        {
+            power = power < 10000 ? power * 10 + (*digit - '0') : power;
+        }
+        exponent += sign * power;
+        p = digit;
+    }
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    {
+        p++;
+    }
+
+    exact = any && digits <= CSV_MAX_DIGITS && mantissa <= ((uint64_t)1 << 53) &&
+            exponent >= -CSV_MAX_EXACT_POWER && exponent <= CSV_MAX_EXACT_POWER;
+    if (exact && (p == end || *p == ','))
+    {
+        double magnitude = (double)mantissa;
+        magnitude = exponent < 0 ? magnitude / CSV_POWERS[-exponent] : magnitude * CSV_POWERS[exponent];
+        *value = negative ? -magnitude : magnitude;
+        return p;
+    }
+    while (p < end && *p != ',')
+    {
+        p++;
+    }
+    *value = csv_strtod(start, p);
+    return p;
+}
+
+/* First byte of the chunk a thread starts at: just past the newline that ends the line running
+ * through its share's first byte */
+static size_t csv_chunk_start(const char *text, size_t length, int thread_id, int num_threads)
+{
+    size_t position = (size_t)((double)length * thread_id / num_threads);
+    const char *newline;
+    if (thread_id == 0)
+    {
+        return 0;
+    }
+    if (thread_id >= num_threads || position >= length)
+    {
+        return length;
+    }
+    newline = (const char *)memchr(text + position - 1, '\n', length - position + 1);
+    return newline ? (size_t)(newline - text) + 1 : length;
+}
+
+static void csv_parse_task(void *arg, int thread_id, int num_threads)
+{
+    CsvTask *task = (CsvTask *)arg;
+    const char *text = task->text, *line = text + csv_chunk_start(text, task->length, thread_id, num_threads);
+    const char *stop = text + csv_chunk_start(text, task->length, thread_id + 1, num_threads);
+    int j, cols = task->cols;
+    size_t capacity = 0, count = 0;
+    double *values = NULL;
+
+    if (thread_id == 0)
+    {
+        task->num_chunks = num_threads;
+    }
+    while (line < stop)
+    {
+        const char *newline = (const char *)memchr(line, '\n', (size_t)(stop - line));
+        const char *line_end = newline ? newline : stop, *field = line, *blank = line;
+        while (blank < line_end && (*blank == ' ' || *blank == '\t' || *blank == '\r'))
+        {
+            blank++;
+        }
+        if (blank == line_end)
+        {
+            line = line_end + 1;
+            continue;
+        }
+        if (count + cols > capacity)
+        {
+            double *grown;
+            capacity = capacity ? 2 * capacity : (size_t)cols * CSV_INITIAL_ROWS;
+            if ((grown = (double *)realloc(values, capacity * sizeof(double))) == NULL)
+            {
+                task->failed = 1;
+                break;
+            }
+            values = grown;
+        }
+        for (j = 0; j < cols && !task->failed; j++)
+        {
+            if (field > line_end)
+            {
+                values[count + j] = 0.0;
+            }
+            else if ((field = csv_parse_field(field, line_end, values + count + j)) == NULL)
+            {
+                task->failed = 1;
+            }
+            else
+            {
+                field++;
+            }
+        }
+        if (task->failed)
+        {
+            break;
+        }
+        count += cols;
+        line = line_end + 1;
+    }
+    task->values[thread_id] = values;
+    task->rows[thread_id] = (int)(count / cols);
+}
+
+static void csv_copy_task(void *arg, int thread_id, int num_threads)
+{
+    CsvTask *task = (CsvTask *)arg;
+    int i, t;
+
+    for (t = thread_id; t < task->num_chunks; t += num_threads)
+    {
+        for (i = task->row_start[t]; i < task->row_start[t + 1]; i++)
+        {
+            memcpy(MATRIX_ROW(task->matrix, i), task->values[t] + (size_t)(i - task->row_start[t]) * task->cols,
+                   task->cols * sizeof(double));
+        }
+    }
+}
+
+Matrix *parse_csv_file(const char *file_name)
+{
+    CsvTask task;
+    struct stat info;
+    const char *first_end;
+    void *mapping;
+    int fd, t;
+    long rows = 0;
+
+    if ((fd = open(file_name, O_RDONLY)) < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    madvise(mapping, (size_t)info.st_size, MADV_WILLNEED);
+
+    memset(&task, 0, sizeof(task));
+    task.text = (const char *)mapping;
+    task.length = (size_t)info.st_size;
+    first_end = (const char *)memchr(task.text, '\n', task.length);
+    first_end = first_end ? first_end : task.text + task.length;
+    for (task.cols = 1; task.text < first_end; task.text++)
+    {
+        task.cols += *task.text == ',';
+    }
+    task.text = (const char *)mapping;
+    parallel_run(csv_parse_task, &task);
+
+    for (t = 0; t < task.num_chunks && rows <= INT_MAX; t++)
+    {
+        task.row_start[t] = (int)rows;
+        rows += task.rows[t];
+    }
+    task.row_start[task.num_chunks] = (int)rows;
+    if (!task.failed && rows > 0 && rows <= INT_MAX && (task.matrix = init_matrix((int)rows, task.cols)) != NULL)
+    {
+        parallel_run(csv_copy_task, &task);
+    }
+    for (t = 0; t < task.num_chunks; t++)
+    {
+        free(task.values[t]);
+    }
+    munmap(mapping, task.length);
+    return task.matrix;
+}
+
+/* Reads a rows x cols CSV file; fails when the file holds other dimensions */
+Matrix *read_file(const char *file_name, int rows, int cols)
+{
+    Matrix *d_points = parse_csv_file(file_name);
+    if (d_points != NULL && (d_points->rows != rows || d_points->cols != cols))
+    {
+        free_matrix_memory(d_points);
+        return NULL;
+    }
+    return d_points;
+}
+
+void calc_matrix_dim(char *file_name, int *dim)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t line_length = 0;
+    ssize_t read;
+    int vec_number = 0, vec_dim = 1;
+    char ch;
+
+    file = fopen(file_name, "r");
+
+    if (file == NULL)
+    {
+        return;
+    }
+
+    while ((ch = fgetc(file)) != '\n')
+    {
+        if (ch == ',')
+        {
+            vec_dim++;
+        }
+    }
+    rewind(file);
+
+    while ((read = getline(&line, &line_length, file)) != -1)
+    {
+        vec_number++;
+    }
+
+    dim[0] = vec_number;
+    dim[1] = vec_dim;
+    fclose(file);
+    free(line);
+}
+
+/* Binary data-point files. The data block starts BINARY_HEADER_BYTES into the file, so a
+ * page-aligned mapping of the file leaves it MATRIX_ALIGNMENT-aligned and usable in place. */
+
+/* FNV-1a over 64-bit words, on four interleaved lanes so the multiplies overlap; it can be fed
+ * in pieces, as long as they arrive in order */
+static uint64_t checksum_prime(void)
+{
+    return ((uint64_t)0x100UL << 32) | 0x1B3UL;
+}
+
+static void checksum_init(BinaryChecksum *checksum)
+{
+    int lane;
+    for (lane = 0; lane < 4; lane++)
+    {
+        checksum->lanes[lane] = ((uint64_t)0xCBF29CE4UL << 32) | (0x84222325UL + lane);
+    }
+    checksum->count = 0;
+}
+
+static void checksum_update(BinaryChecksum *checksum, const double *data, size_t count)
+{
+    uint64_t prime = checksum_prime();
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        DoubleBits word;
+        word.value = data[i];
+        checksum->lanes[(checksum->count + i) % 4] = (checksum->lanes[(checksum->count + i) % 4] ^ word.bits) * prime;
+    }
+    checksum->count += count;
+}
+
+static uint64_t checksum_final(const BinaryChecksum *checksum)
+{
+    uint64_t prime = checksum_prime(), value = 0;
+    int lane;
+    for (lane = 0; lane < 4; lane++)
+    {
+        value = (value ^ checksum->lanes[lane]) * prime;
+    }
+    return value;
+}
+
+static uint64_t binary_checksum(const double *data, size_t count)
+{
+    BinaryChecksum checksum;
+    checksum_init(&checksum);
+    checksum_update(&checksum, data, count);
+    return checksum_final(&checksum);
+}
+
+static size_t binary_data_doubles(int rows, int stride)
+{
+    return (size_t)rows * (size_t)stride;
+}
+
+int is_binary_matrix_file(const char *file_name)
+{
+    char magic[sizeof(BINARY_MAGIC) - 1];
+    int fd = open(file_name, O_RDONLY), binary;
+    if (fd < 0)
+    {
+        return 0;
+    }
+    binary = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) && !memcmp(magic, BINARY_MAGIC, sizeof(magic));
+    close(fd);
+    return binary;
+}
+
+static void binary_header(char *header, int rows, int cols, int stride, uint64_t checksum)
+{
+    int dtype = BINARY_DTYPE_FLOAT64;
+    memset(header, 0, BINARY_HEADER_BYTES);
+    memcpy(header, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1);
+    memcpy(header + 8, &rows, sizeof(int));
+    memcpy(header + 12, &cols, sizeof(int));
+    memcpy(header + 16, &stride, sizeof(int));
+    memcpy(header + 20, &dtype, sizeof(int));
+    memcpy(header + 24, &checksum, sizeof(checksum));
+}
+
+int write_binary_matrix(const Matrix *matrix, const char *file_name)
+{
+    char header[BINARY_HEADER_BYTES];
+    int fd, failed;
+    size_t count = binary_data_doubles(matrix->rows, matrix->stride);
+
+    binary_header(header, matrix->rows, matrix->cols, matrix->stride, binary_checksum(matrix->data, count));
+    if ((fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        return 1;
+    }
+    failed = disk_transfer(fd, header, sizeof(header), 0, 1) ||
+             disk_transfer(fd, matrix->data, count * sizeof(double), BINARY_HEADER_BYTES, 1);
+    return close(fd) != 0 || failed;
+}
+
+/* Maps the file copy-on-write; nothing is read until the pages are touched, unless verify asks
+ * for the data checksum to be checked up front */
+Matrix *map_binary_matrix(const char *file_name, int verify)
+{
+    char header[BINARY_HEADER_BYTES];
+    int fd, rows, cols, stride, dtype;
+    uint64_t checksum;
+    struct stat info;
+    size_t bytes, data_bytes;
+    void *mapping;
+    Matrix *matrix;
+
+    if ((fd = open(file_name, O_RDONLY)) < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(header) || disk_transfer(fd, header, sizeof(header), 0, 0) ||
+        memcmp(header, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1))
+    {
+        close(fd);
+        return NULL;
+    }
+    memcpy(&rows, header + 8, sizeof(int));
+    memcpy(&cols, header + 12, sizeof(int));
+    memcpy(&stride, header + 16, sizeof(int));
+    memcpy(&dtype, header + 20, sizeof(int));
+    memcpy(&checksum, header + 24, sizeof(checksum));
+    /* The header must describe exactly the rest of the file. rows * stride is never formed: the
+     * data size is divided instead, so a forged header cannot overflow into a match. */
+    bytes = (size_t)info.st_size;
+    data_bytes = bytes - BINARY_HEADER_BYTES;
+    if (rows < 1 || cols < 1 || stride < cols || dtype != BINARY_DTYPE_FLOAT64 ||
+        (size_t)stride > data_bytes / sizeof(double) || data_bytes % ((size_t)stride * sizeof(double)) != 0 ||
+        data_bytes / ((size_t)stride * sizeof(double)) != (size_t)rows)
+    {
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if ((matrix = (Matrix *)malloc(sizeof(Matrix))) == NULL)
+    {
+        munmap(mapping, bytes);
+        return NULL;
+    }
+    matrix->data = (double *)((char *)mapping + BINARY_HEADER_BYTES);
+    matrix->rows = rows;
+    matrix->cols = cols;
+    matrix->stride = stride;
+    matrix->mapping = mapping;
+    matrix->mapping_bytes = bytes;
+    matrix->release = NULL;
+    matrix->owner = NULL;
+    if (verify && binary_checksum(matrix->data, binary_data_doubles(rows, stride)) != checksum)
+    {
+        munmap(mapping, bytes);
+        free(matrix);
+        return NULL;
+    }
+    return matrix;
+}
+
+int convert_to_binary(const char *csv_name, const char *binary_name)
 {
-    int i, j;
-    double **matrix = (double **)malloc(rows * sizeof(double *));
-    if (!matrix)
+    int failed;
+    Matrix *d_points;
+
+    if ((d_points = parse_csv_file(csv_name)) == NULL)
     {
-        return NULL;
+        return 1;
     }
+    failed = write_binary_matrix(d_points, binary_name);
+    free_matrix_memory(d_points);
+    return failed;
+}
+
+/* GEMM engine: C = op(A) * op(B) (+ C). The product is split into KC x NC panels of op(B)
+ * and MC x KC blocks of op(A), both packed into contiguous, zero-padded micro-panels,
+ * and an MR x NR micro-kernel accumulates each tile of C in registers. */
 
-    for (i = 0; i < rows; i++)
+static void gemm_pack_a(int trans_a, const double *a, size_t lda, int i0, int k0, int mc, int kc, double *buf)
+{
+    int ip, r, kk;
+    for (ip = 0; ip < mc; ip += GEMM_MR)
     {
-        matrix[i] = (double *)calloc(cols, sizeof(double));
-        if (!matrix[i])
+        double *panel = buf + (size_t)ip * kc;
+        int rows = (mc - ip < GEMM_MR) ? mc - ip : GEMM_MR;
+        for (r = 0; r < GEMM_MR; r++)
         {
-            for (j = 0; j < i; j++)
+            if (r >= rows)
+            {
+                for (kk = 0; kk < kc; kk++)
+                {
+                    panel[kk * GEMM_MR + r] = 0.0;
+                }
+            }
+            else if (trans_a)
+            {
+                const double *src = a + (size_t)k0 * lda + (i0 + ip + r);
+                for (kk = 0; kk < kc; kk++)
+                {
+                    panel[kk * GEMM_MR + r] = src[(size_t)kk * lda];
+                }
+            }
+            else
             {
-                free(matrix[j]);
+                const double *src = a + (size_t)(i0 + ip + r) * lda + k0;
+                for (kk = 0; kk < kc; kk++)
+                {
+                    panel[kk * GEMM_MR + r] = src[kk];
+                }
             }
-            free(matrix);
-            return NULL;
         }
     }
-    return matrix;
 }
 
-void free_matrix_memory(double **matrix, int vec_number)
+static void gemm_pack_b(int trans_b, const double *b, size_t ldb, int k0, int j0, int kc, int nc, double *buf)
 {
-    int i;
-    if (!matrix)
-    {
-        return;
-    }
-    for (i = 0; i < vec_number; i++)
+    int jp, c, kk;
+    for (jp = 0; jp < nc; jp += GEMM_NR)
     {
-        free(matrix[i]);
+        double *panel = buf + (size_t)jp * kc;
+        int cols = (nc - jp < GEMM_NR) ? nc - jp : GEMM_NR;
+        if (trans_b)
+        {
+            for (c = 0; c < GEMM_NR; c++)
+            {
+                const double *src = b + (size_t)(j0 + jp + c) * ldb + k0;
+                for (kk = 0; kk < kc; kk++)
+                {
+                    panel[kk * GEMM_NR + c] = (c < cols) ? src[kk] : 0.0;
+                }
+            }
+        }
+        else
+        {
+            for (kk = 0; kk < kc; kk++)
+            {
+                const double *src = b + (size_t)(k0 + kk) * ldb + j0 + jp;
+                for (c = 0; c < GEMM_NR; c++)
+                {
+                    panel[kk * GEMM_NR + c] = (c < cols) ? src[c] : 0.0;
+                }
+            }
+        }
     }
-    free(matrix);
 }
 
-double **calc_similarity_matrix(int vec_number, int vec_dim, double **d_points)
+static void gemm_micro_kernel(int kc, const double *ap, const double *bp, double *c, size_t ldc,
+                              int rows, int cols, int accumulate)
 {
-    int i, j;
-    double **matrix;
-    if ((matrix = init_matrix(vec_number, vec_number)) == NULL)
+    int kk, r, j;
+    double acc[GEMM_MR * GEMM_NR];
+
+    for (r = 0; r < GEMM_MR * GEMM_NR; r++)
     {
-        return NULL;
+        acc[r] = 0.0;
     }
-    for (i = 0; i < vec_number; i++)
+    for (kk = 0; kk < kc; kk++)
+    {
+        const double *a_col = ap + kk * GEMM_MR;
+        const double *b_row = bp + kk * GEMM_NR;
+        for (r = 0; r < GEMM_MR; r++)
+        {
+            double a_val = a_col[r];
+            for (j = 0; j < GEMM_NR; j++)
+            {
+                acc[r * GEMM_NR + j] += a_val * b_row[j];
+            }
+        }
+    }
+
+    for (r = 0; r < rows; r++)
     {
-        for (j = 0; j < vec_number; j++)
+        double *c_row = c + (size_t)r * ldc;
+        for (j = 0; j < cols; j++)
         {
-            matrix[i][j] = (i == j) ? 0 : calculate_squared_euclidean_distance(d_points[i], d_points[j], vec_dim);
+            c_row[j] = accumulate ? c_row[j] + acc[r * GEMM_NR + j] : acc[r * GEMM_NR + j];
         }
     }
-    return matrix;
 }
 
-double **calc_diagonal_matrix(int vec_number, int vec_dim, double **d_points)
+#ifdef SYMNMF_X86_DISPATCH
+/* The same 8 x 4 tile with one FMA per row and packed column of B */
+__attribute__((target("avx2,fma"))) static void gemm_micro_kernel_avx2(int kc, const double *ap, const double *bp,
+                                                                       double *c, size_t ldc, int rows, int cols,
+                                                                       int accumulate)
 {
-    int i;
-    double **matrix, **sim_matrix;
-    matrix = init_matrix(vec_number, vec_number);
-    sim_matrix = calc_similarity_matrix(vec_number, vec_dim, d_points);
-    if (matrix == NULL || sim_matrix == NULL)
+    int kk, r, j;
+    double acc[GEMM_MR * GEMM_NR];
+    __m256d c0 = _mm256_setzero_pd(), c1 = _mm256_setzero_pd(), c2 = _mm256_setzero_pd();
+    __m256d c3 = _mm256_setzero_pd(), c4 = _mm256_setzero_pd(), c5 = _mm256_setzero_pd();
+    __m256d c6 = _mm256_setzero_pd(), c7 = _mm256_setzero_pd();
+
+    for (kk = 0; kk < kc; kk++)
     {
-        free_matrix_memory(matrix, vec_number);
-        free_matrix_memory(sim_matrix, vec_number);
-        return NULL;
+        const double *a_col = ap + kk * GEMM_MR;
+        __m256d b_row = _mm256_loadu_pd(bp + kk * GEMM_NR);
+        c0 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 0), b_row, c0);
+        c1 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 1), b_row, c1);
+        c2 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 2), b_row, c2);
+        c3 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 3), b_row, c3);
+        c4 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 4), b_row, c4);
+        c5 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 5), b_row, c5);
+        c6 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 6), b_row, c6);
+        c7 = _mm256_fmadd_pd(_mm256_broadcast_sd(a_col + 7), b_row, c7);
     }
+    _mm256_storeu_pd(acc + 0 * GEMM_NR, c0);
+    _mm256_storeu_pd(acc + 1 * GEMM_NR, c1);
+    _mm256_storeu_pd(acc + 2 * GEMM_NR, c2);
+    _mm256_storeu_pd(acc + 3 * GEMM_NR, c3);
+    _mm256_storeu_pd(acc + 4 * GEMM_NR, c4);
+    _mm256_storeu_pd(acc + 5 * GEMM_NR, c5);
+    _mm256_storeu_pd(acc + 6 * GEMM_NR, c6);
+    _mm256_storeu_pd(acc + 7 * GEMM_NR, c7);
 
-    for (i = 0; i < vec_number; i++)
+    for (r = 0; r < rows; r++)
     {
-        matrix[i][i] = sum_vector_coordinates(sim_matrix[i], vec_number);
+        double *c_row = c + (size_t)r * ldc;
+        for (j = 0; j < cols; j++)
+        {
+            c_row[j] = accumulate ? c_row[j] + acc[r * GEMM_NR + j] : acc[r * GEMM_NR + j];
+        }
     }
-    free_matrix_memory(sim_matrix, vec_number);
-    return matrix;
 }
+#endif
 
-double **calc_normalized_similarity_matrix(int vec_number, int vec_dim, double **d_points)
+static void gemm_blocked(int trans_a, int trans_b, int m, int n, int k,
+                         const double *a, size_t lda, const double *b, size_t ldb,
+                         double *c, size_t ldc, int accumulate, double *pack_a, double *pack_b)
 {
-    int i;
-    double **res_da = NULL;
-    double **final_res = NULL;
-    double **A = calc_similarity_matrix(vec_number, vec_dim, d_points);
-    double **D = calc_diagonal_matrix(vec_number, vec_dim, d_points);
-    if (A == NULL || D == NULL)
+    int jc, pc, ic, jr, ir;
+    void (*micro_kernel)(int, const double *, const double *, double *, size_t, int, int, int) = gemm_micro_kernel;
+#ifdef SYMNMF_X86_DISPATCH
+    if (get_simd_level() >= SIMD_AVX2)
     {
-        free_matrix_memory(A, vec_number);
-        free_matrix_memory(D, vec_number);
+        micro_kernel = gemm_micro_kernel_avx2;
     }
-
-    for (i = 0; i < vec_number; ++i)
+#endif
+    if (k == 0 && !accumulate)
     {
-        D[i][i] = 1 / sqrt(D[i][i]);
+        for (ic = 0; ic < m; ic++)
+        {
+            memset(c + (size_t)ic * ldc, 0, n * sizeof(double));
+        }
+        return;
     }
-    res_da = matrix_multiplication(D, A, vec_number, vec_number, vec_number);
-    final_res = res_da ? matrix_multiplication(res_da, D, vec_number, vec_number, vec_number) : NULL;
 
-    free_matrix_memory(A, vec_number);
-    free_matrix_memory(D, vec_number);
-    free_matrix_memory(res_da, vec_number);
-
-    return final_res;
+    for (jc = 0; jc < n; jc += GEMM_NC)
+    {
+        int nc = (n - jc < GEMM_NC) ? n - jc : GEMM_NC;
+        for (pc = 0; pc < k; pc += GEMM_KC)
+        {
+            int kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+            int acc_flag = accumulate || pc > 0;
+            gemm_pack_b(trans_b, b, ldb, pc, jc, kc, nc, pack_b);
+            for (ic = 0; ic < m; ic += GEMM_MC)
+            {
+                int mc = (m - ic < GEMM_MC) ? m - ic : GEMM_MC;
+                gemm_pack_a(trans_a, a, lda, ic, pc, mc, kc, pack_a);
+                for (jr = 0; jr < nc; jr += GEMM_NR)
+                {
+                    for (ir = 0; ir < mc; ir += GEMM_MR)
+                    {
+                        micro_kernel(kc, pack_a + (size_t)ir * kc, pack_b + (size_t)jr * kc,
+                                     c + (size_t)(ic + ir) * ldc + jc + jr, ldc,
+                                     (mc - ir < GEMM_MR) ? mc - ir : GEMM_MR,
+                                     (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR, acc_flag);
+                    }
+                }
+            }
+        }
+    }
 }
 
-double **get_next_H_matrix(int k, int vec_number, double **norm_matrix, double **H)
+/* Each thread multiplies its own band of MR-aligned rows of C with private packing buffers.
+ * Every entry of C is still accumulated in the same order, whatever the thread count. */
+static void gemm_task(void *arg, int thread_id, int num_threads)
 {
-    int i, j;
-    double **WH, **HH_transpose, **HH_transpose_H, **H_transpose, **next_h;
-    if ((next_h = init_matrix(vec_number, k)) == NULL)
+    GemmTask *task = (GemmTask *)arg;
+    int panels = (task->m + GEMM_MR - 1) / GEMM_MR;
+    int first = (int)((long)panels * thread_id / num_threads) * GEMM_MR;
+    int last = (int)((long)panels * (thread_id + 1) / num_threads) * GEMM_MR;
+    int nc_max = (task->n < GEMM_NC) ? (task->n + GEMM_NR - 1) / GEMM_NR * GEMM_NR : GEMM_NC;
+    void *pack_a = NULL, *pack_b = NULL;
+    const double *a;
+
+    last = last < task->m ? last : task->m;
+    if (first >= last)
     {
-        return NULL;
+        return;
     }
-    WH = matrix_multiplication(norm_matrix, H, vec_number, vec_number, k);
-    H_transpose = calc_matrix_transpose(H, k, vec_number);
-    HH_transpose = matrix_multiplication(H, H_transpose, vec_number, k, vec_number);
-    HH_transpose_H = matrix_multiplication(HH_transpose, H, vec_number, vec_number, k);
-
-    if (WH == NULL || H_transpose == NULL || HH_transpose_H == NULL || HH_transpose_H == NULL)
+    if (thread_id < task->num_buffers && task->buffer_size >= gemm_buffer_size(task->n))
     {
-        free_matrix_memory(next_h, vec_number);
-        free_matrix_memory(H_transpose, k);
-        free_matrix_memory(HH_transpose, vec_number);
-        free_matrix_memory(HH_transpose_H, vec_number);
-        free_matrix_memory(WH, vec_number);
-        return NULL;
+        double *buffer = task->buffers + (size_t)thread_id * task->buffer_size;
+        a = task->trans_a ? task->a + first : task->a + (size_t)first * task->lda;
+        gemm_blocked(task->trans_a, task->trans_b, last - first, task->n, task->k, a, task->lda,
+                     task->b, task->ldb, task->c + (size_t)first * task->ldc, task->ldc,
+                     task->accumulate, buffer, buffer + (size_t)GEMM_MC * GEMM_KC);
+        return;
     }
-
-    for (i = 0; i < vec_number; i++)
+    if (posix_memalign(&pack_a, MATRIX_ALIGNMENT, (size_t)GEMM_MC * GEMM_KC * sizeof(double)) != 0)
     {
-        for (j = 0; j < k; j++)
-        {
-            double ratio = WH[i][j] / HH_transpose_H[i][j];
-            next_h[i][j] = H[i][j] * (BETA * ratio + (1 - BETA));
-        }
+        task->failed = 1;
+        return;
     }
-    free_matrix_memory(H_transpose, k);
-    free_matrix_memory(HH_transpose, vec_number);
-    free_matrix_memory(HH_transpose_H, vec_number);
-    free_matrix_memory(WH, vec_number);
-    return next_h;
+    if (posix_memalign(&pack_b, MATRIX_ALIGNMENT, (size_t)GEMM_KC * (nc_max ? nc_max : 1) * sizeof(double)) != 0)
+    {
+        free(pack_a);
+        task->failed = 1;
+        return;
+    }
+
+    a = task->trans_a ? task->a + first : task->a + (size_t)first * task->lda;
+    gemm_blocked(task->trans_a, task->trans_b, last - first, task->n, task->k, a, task->lda,
+                 task->b, task->ldb, task->c + (size_t)first * task->ldc, task->ldc,
+                 task->accumulate, (double *)pack_a, (double *)pack_b);
+    free(pack_a);
+    free(pack_b);
 }
 
-int has_converged(int k, int vec_number, double **H, double **next_h)
+/* Doubles of packing space one thread needs for a product whose C has n columns */
+static size_t gemm_buffer_size(int n)
 {
-    int i, j;
-    double norm = 0.0;
+    int nc_max = (n < GEMM_NC) ? (n + GEMM_NR - 1) / GEMM_NR * GEMM_NR : GEMM_NC;
+    size_t size = (size_t)GEMM_MC * GEMM_KC + (size_t)GEMM_KC * (nc_max ? nc_max : 1);
+    return (size + MATRIX_ROW_PAD - 1) / MATRIX_ROW_PAD * MATRIX_ROW_PAD;
+}
 
-    for (i = 0; i < vec_number; i++)
+int gemm(int trans_a, int trans_b, const Matrix *A, const Matrix *B, Matrix *C, int accumulate)
+{
+    return gemm_buffered(trans_a, trans_b, A, B, C, accumulate, NULL, 0, 0);
+}
+
+/* gemm with caller-owned packing space: thread t < num_buffers packs into buffers + t * buffer_size
+ * when that holds gemm_buffer_size(columns of C) doubles, any other thread allocates its own */
+static int gemm_buffered(int trans_a, int trans_b, const Matrix *A, const Matrix *B, Matrix *C, int accumulate,
+                         double *buffers, size_t buffer_size, int num_buffers)
+{
+    GemmTask task;
+    int kb = trans_b ? B->cols : B->rows;
+
+    task.trans_a = trans_a;
+    task.trans_b = trans_b;
+    task.m = trans_a ? A->cols : A->rows;
+    task.k = trans_a ? A->rows : A->cols;
+    task.n = trans_b ? B->rows : B->cols;
+    if (task.k != kb || C->rows != task.m || C->cols != task.n)
     {
-        for (j = 0; j < k; j++)
-        {
-            norm += pow((next_h[i][j] - H[i][j]), 2);
-        }
+        return 1;
     }
+    task.a = A->data;
+    task.lda = A->stride;
+    task.b = B->data;
+    task.ldb = B->stride;
+    task.c = C->data;
+    task.ldc = C->stride;
+    task.accumulate = accumulate;
+    task.failed = 0;
+    task.buffers = buffers;
+    task.buffer_size = buffer_size;
+    task.num_buffers = num_buffers;
 
-    return (norm < EPSILON);
+    if ((double)task.m * task.n * (task.k + 1) < GEMM_PARALLEL_MIN_WORK)
+    {
+        gemm_task(&task, 0, 1);
+    }
+    else
+    {
+        parallel_run(gemm_task, &task);
+    }
+    return task.failed;
 }
 
-double **calc_symnmf(int k, int vec_number, double **norm_matrix, double **H)
+static Matrix *gemm_new(int trans_a, int trans_b, const Matrix *A, const Matrix *B)
 {
-    int i;
-    double **curr_h, **next_h, **temp;
-    curr_h = H;
-    if ((next_h = get_next_H_matrix(k, vec_number, norm_matrix, H)) == NULL)
+    Matrix *res_matrix;
+    if (!A || !B)
     {
         return NULL;
     }
-
-    for (i = 0; i < MAX_ITER && !has_converged(k, vec_number, curr_h, next_h); i++)
+    res_matrix = init_matrix(trans_a ? A->cols : A->rows, trans_b ? B->rows : B->cols);
+    if (res_matrix && gemm(trans_a, trans_b, A, B, res_matrix, 0) != 0)
     {
-        make_a_copy(curr_h, next_h, vec_number, k);
-        temp = get_next_H_matrix(k, vec_number, norm_matrix, curr_h);
-        if (!temp)
-        {
-            free_matrix_memory(next_h, vec_number);
-            return NULL;
-        }
-        free_matrix_memory(next_h, vec_number);
-        next_h = temp;
+        free_matrix_memory(res_matrix);
+        return NULL;
     }
+    return res_matrix;
+}
 
-    return next_h;
+Matrix *matrix_multiplication(const Matrix *matrix1, const Matrix *matrix2)
+{
+    return gemm_new(0, 0, matrix1, matrix2);
 }
 
-double sum_vector_coordinates(double *v1, int vec_dim)
+Matrix *matrix_multiplication_tn(const Matrix *matrix1, const Matrix *matrix2)
 {
-    int i;
-    double sum = 0.0;
-    for (i = 0; i < vec_dim; i++)
-    {
-        sum += v1[i];
-    }
-    return sum;
+    return gemm_new(1, 0, matrix1, matrix2);
 }
 
-double calculate_squared_euclidean_distance(double *v1, double *v2, int vec_dim)
+Matrix *matrix_multiplication_nt(const Matrix *matrix1, const Matrix *matrix2)
+{
+    return gemm_new(0, 1, matrix1, matrix2);
+}
+
+void make_a_copy(Matrix *dest, const Matrix *src)
 {
     int i;
-    double sum = 0.0;
-    for (i = 0; i < vec_dim; i++)
+    for (i = 0; i < src->rows; i++)
     {
-        sum += pow((v1[i] - v2[i]), 2);
+        memcpy(MATRIX_ROW(dest, i), MATRIX_ROW(src, i), src->cols * sizeof(double));
     }
-    return exp((-0.5) * sum);
 }
 
-double **read_file(const char *file_name, int rows, int cols)
+PackedMatrix *calc_matrix_by_goal(char *goal, const Matrix *d_points)
 {
-    char *token = NULL, *line = NULL;
-    double **d_points;
-    int i = 0, j = 0;
-    FILE *file;
-    size_t line_length = 0;
-    ssize_t read;
-
-    file = fopen(file_name, "r");
-    if (file == NULL)
+    if (!strcmp(goal, "sym"))
     {
-        printf("An Error Has Occoured");
-        exit(EXIT_FAILURE);
+        return calc_packed_similarity_matrix(d_points);
     }
-    if ((d_points = init_matrix(rows, cols)) == NULL)
+    else if (!strcmp(goal, "ddg"))
     {
-        fclose(file);
-        return NULL;
+        return calc_packed_diagonal_matrix(d_points);
     }
-
-    while ((read = getline(&line, &line_length, file)) != -1 && i < rows)
+    else if (!strcmp(goal, "norm"))
     {
-        token = strtok(line, ",");
-        for (j = 0; j < cols && token != NULL; j++)
-        {
-            d_points[i][j] = strtod(token, NULL);
-            token = strtok(NULL, ",");
-        }
-        i++;
+        return calc_packed_normalized_similarity_matrix(d_points);
     }
-
-    free(line);
-    free(token);
-    fclose(file);
-
-    if (i != rows)
+    else
     {
-        free_matrix_memory(d_points, rows);
         return NULL;
     }
-
-    return d_points;
 }
 
-void calc_matrix_dim(char *file_name, int *dim)
-{
-    FILE *file;
-    char *line = NULL;
-    size_t line_length = 0;
-    ssize_t read;
-    int vec_number = 0, vec_dim = 1;
-    char ch;
+/* Output. Matrices are printed as "%.4f" text through per-thread buffers, PRINT_BATCH_ELEMENTS
+ * entries at a time: every thread formats a contiguous share of the batch's rows and the shares
+ * are written in row order. With an output file set, the matrix goes to that file in the binary
+ * data-point format instead. */
 
-    file = fopen(file_name, "r");
+static char *output_file = NULL;
+static int output_file_read = 0;
 
-    if (file == NULL)
+/* SYMNMF_OUTPUT_FILE=path picks binary output until set_output_file is called */
+const char *get_output_file(void)
+{
+    if (!output_file_read)
     {
-        return;
+        const char *env = getenv("SYMNMF_OUTPUT_FILE");
+        output_file_read = 1;
+        set_output_file(env != NULL && *env ? env : NULL);
     }
+    return output_file;
+}
 
-    while ((ch = fgetc(file)) != '\n')
+/* NULL (or "") restores text output on stdout */
+int set_output_file(const char *file_name)
+{
+    char *copy = NULL;
+    output_file_read = 1;
+    if (file_name != NULL && *file_name)
     {
-        if (ch == ',')
+        if ((copy = (char *)malloc(strlen(file_name) + 1)) == NULL)
         {
-            vec_dim++;
+            return 1;
         }
+        strcpy(copy, file_name);
     }
-    rewind(file);
+    free(output_file);
+    output_file = copy;
+    return 0;
+}
 
-    while ((read = getline(&line, &line_length, file)) != -1)
+/* Writes x exactly as printf("%.4f", x) does: the binary value rounded half-to-even at the fourth
+ * decimal. |x| * 10^4 is split error-free into p + e (Dekker's product; 10^4 needs 14 bits), so
+ * the rounding decision is taken on the exact product. Returns the end of the text. */
+static char *format_fixed4(char *out, double x)
+{
+    DoubleBits bits;
+    double magnitude = fabs(x), p, e, split, hi, below, d;
+    uint64_t scaled, whole;
+    char digits[24];
+    int count = 0, fraction;
+
+    if (!(magnitude < PRINT_FAST_LIMIT))
     {
-        vec_number++;
+        return out + sprintf(out, "%.4f", x);
     }
+    bits.value = x;
+    p = magnitude * 10000.0;
+    split = magnitude * 134217729.0;
+    hi = split - (split - magnitude);
+    e = (hi * 10000.0 - p) + (magnitude - hi) * 10000.0;
+    below = floor(p);
+    d = (p - below - 0.5) + e;
+    scaled = (uint64_t)below + (d > 0 || (d == 0 && ((uint64_t)below & 1)));
 
-    dim[0] = vec_number;
-    dim[1] = vec_dim;
-    fclose(file);
-    free(line);
+    if (bits.bits >> 63)
+    {
+        *out++ = '-';
+    }
+    whole = scaled / 10000;
+    fraction = (int)(scaled % 10000);
+    do
+    {
+        digits[count++] = (char)('0' + whole % 10);
+        whole /= 10;
+    } while (whole > 0);
+    while (count > 0)
+    {
+        *out++ = digits[--count];
+    }
+    out[0] = '.';
+    out[1] = (char)('0' + fraction / 1000);
+    out[2] = (char)('0' + fraction / 100 % 10);
+    out[3] = (char)('0' + fraction / 10 % 10);
+    out[4] = (char)('0' + fraction % 10);
+    return out + 5;
 }
 
-double **matrix_multiplication(double **matrix1, double **matrix2, int rows1, int cols1, int cols2)
+static double print_value(const PrintTask *task, int i, int j)
 {
-    int i, j, k;
-    double **resMatrix;
-    if (!matrix1 || !matrix2 || (resMatrix = init_matrix(rows1, cols2)) == NULL)
+    if (task->dense)
     {
-        return NULL;
+        return MATRIX_AT(task->dense, i, j);
+    }
+    if (task->packed)
+    {
+        return (j >= i) ? PACKED_ROW(task->packed, i)[j] : PACKED_ROW(task->packed, j)[i];
+    }
+    if (task->packed_float)
+    {
+        return (j >= i) ? PACKED_ROW(task->packed_float, i)[j] : PACKED_ROW(task->packed_float, j)[i];
     }
+    return (i == j) ? task->diagonal[i] : 0.0;
+}
 
-    for (i = 0; i < rows1; i++)
+static void print_rows_task(void *arg, int thread_id, int num_threads)
+{
+    PrintTask *task = (PrintTask *)arg;
+    int i, j, first, last;
+    size_t length = 0;
+
+    if (thread_id == 0)
+    {
+        task->num_chunks = num_threads;
+    }
+    static_row_range(task->last_row - task->first_row, thread_id, num_threads, &first, &last);
+    for (i = task->first_row + first; i < task->first_row + last; i++)
     {
-        for (j = 0; j < cols2; j++)
+        for (j = 0; j < task->cols; j++)
         {
-            for (k = 0; k < cols1; k++)
+            if (length + PRINT_MAX_FIELD > task->capacity[thread_id])
             {
-                resMatrix[i][j] += matrix1[i][k] * matrix2[k][j];
+                size_t capacity = 2 * task->capacity[thread_id] + (size_t)PRINT_MAX_FIELD * task->cols;
+                char *grown = (char *)realloc(task->text[thread_id], capacity);
+                if (grown == NULL)
+                {
+                    task->failed = 1;
+                    task->length[thread_id] = length;
+                    return;
+                }
+                task->text[thread_id] = grown;
+                task->capacity[thread_id] = capacity;
             }
+            length = (size_t)(format_fixed4(task->text[thread_id] + length, print_value(task, i, j)) - task->text[thread_id]);
+            task->text[thread_id][length++] = (j != task->cols - 1) ? ',' : '\n';
         }
     }
-    return resMatrix;
+    task->length[thread_id] = length;
 }
-double **calc_matrix_transpose(double **matrix, int vec_number, int vec_dim)
+
+/* The rows of a non-dense matrix expanded one at a time into the binary format, after a first
+ * pass over them for the checksum */
+static int print_binary_rows(const PrintTask *task, const char *file_name)
 {
-    int i, j;
-    double **resMatrix;
-    if ((resMatrix = init_matrix(vec_number, vec_dim)) == NULL)
+    char header[BINARY_HEADER_BYTES];
+    int i, j, pass, fd, failed = 0;
+    int stride = task->cols >= MATRIX_ROW_PAD ? (task->cols + MATRIX_ROW_PAD - 1) / MATRIX_ROW_PAD * MATRIX_ROW_PAD : task->cols;
+    double *row = (double *)calloc(stride ? stride : 1, sizeof(double));
+    BinaryChecksum checksum;
+
+    if (row == NULL || (fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
     {
-        return NULL;
+        free(row);
+        return 1;
     }
-
-    for (i = 0; i < vec_number; i++)
+    checksum_init(&checksum);
+    for (pass = 0; pass < 2 && !failed; pass++)
     {
-        for (j = 0; j < vec_dim; j++)
+        for (i = 0; i < task->rows && !failed; i++)
+        {
+            for (j = 0; j < task->cols; j++)
+            {
+                row[j] = print_value(task, i, j);
+            }
+            if (pass == 0)
+            {
+                checksum_update(&checksum, row, stride);
+                continue;
+            }
+            failed = disk_transfer(fd, row, stride * sizeof(double),
+                                   (off_t)BINARY_HEADER_BYTES + (off_t)i * stride * (off_t)sizeof(double), 1);
+        }
+        if (pass == 0)
         {
-            resMatrix[i][j] = matrix[j][i];
+            binary_header(header, task->rows, task->cols, stride, checksum_final(&checksum));
+            failed = disk_transfer(fd, header, sizeof(header), 0, 1);
         }
     }
-    return resMatrix;
+    free(row);
+    return close(fd) != 0 || failed;
 }
 
-void make_a_copy(double **dest, double **src, int rows, int cols)
+/* 0 once the whole matrix is written, 1 when a write or an allocation failed */
+static int print_output(PrintTask *task)
 {
-    int i;
-    for (i = 0; i < rows; i++)
-    {
-        memcpy(dest[i], src[i], cols * sizeof(double));
-    }
-}
+    const char *file_name = get_output_file();
+    int t, batch, failed = 0;
 
-double **calc_matrix_by_goal(char *goal, double **d_points, int vec_number, int vec_dim)
-{
-    if (!strcmp(goal, "sym"))
-    {
-        return calc_similarity_matrix(vec_number, vec_dim, d_points);
-    }
-    else if (!strcmp(goal, "ddg"))
+    if (file_name != NULL)
     {
-        return calc_diagonal_matrix(vec_number, vec_dim, d_points);
+        return task->dense ? write_binary_matrix(task->dense, file_name) : print_binary_rows(task, file_name);
     }
-    else if (!strcmp(goal, "norm"))
+    batch = task->cols > 0 && PRINT_BATCH_ELEMENTS / task->cols > 0 ? PRINT_BATCH_ELEMENTS / task->cols : 1;
+    for (task->first_row = 0; task->first_row < task->rows && !failed; task->first_row = task->last_row)
     {
-        return calc_normalized_similarity_matrix(vec_number, vec_dim, d_points);
+        task->last_row = task->rows - task->first_row < batch ? task->rows : task->first_row + batch;
+        parallel_run(print_rows_task, task);
+        failed = task->failed;
+        for (t = 0; t < task->num_chunks && !failed; t++)
+        {
+            failed = fwrite(task->text[t], 1, task->length[t], stdout) != task->length[t];
+        }
     }
-    else
+    for (t = 0; t < MAX_THREADS; t++)
     {
-        return NULL;
+        free(task->text[t]);
     }
+    /* the module prints between Python writes to the same descriptor */
+    return fflush(stdout) != 0 || failed;
 }
 
-void print_matrix(double **d_points, int vec_number, int vec_dim)
+int print_matrix(const Matrix *matrix)
 {
-    int i, j;
-    for (i = 0; i < vec_number; i++)
-    {
-        for (j = 0; j < vec_dim; j++)
-        {
-            printf("%.4f", d_points[i][j]);
-            if (j != vec_dim - 1)
-            {
-                printf(",");
-            }
-        }
-        printf("\n");
-    }
+    PrintTask task;
+    memset(&task, 0, sizeof(task));
+    task.dense = matrix;
+    task.rows = matrix->rows;
+    task.cols = matrix->cols;
+    return print_output(&task);
+}
+
+int print_packed_matrix(const PackedMatrix *matrix)
+{
+    PrintTask task;
+    memset(&task, 0, sizeof(task));
+    task.packed = matrix;
+    task.rows = matrix->size;
+    task.cols = matrix->size;
+    return print_output(&task);
+}
+
+int print_packed_float_matrix(const PackedFloatMatrix *matrix)
+{
+    PrintTask task;
+    memset(&task, 0, sizeof(task));
+    task.packed_float = matrix;
+    task.rows = matrix->size;
+    task.cols = matrix->size;
+    return print_output(&task);
+}
+
+/* Prints diag(diagonal) in the print_matrix format without materializing it */
+int print_diagonal_matrix(const double *diagonal, int size)
+{
+    PrintTask task;
+    memset(&task, 0, sizeof(task));
+    task.diagonal = diagonal;
+    task.rows = size;
+    task.cols = size;
+    return print_output(&task);
 }
 
 int main(int argc, char *argv[])
 {
-    int vec_number, vec_dim;
-    double **d_points, **res_matrix;
+    int vec_number, failed;
+    Matrix *d_points;
+    PackedMatrix *res_matrix;
     char *goal = argv[1];
     char *file_name = argv[2];
-    int dim[2];
 
+    /* symnmf convert input.txt output.bin */
+    if (argc == 4 && !strcmp(goal, "convert"))
+    {
+        if (convert_to_binary(argv[2], argv[3]) != 0)
+        {
+            printf("An Error Has Occoured");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
     if (argc != 3)
     {
         return EXIT_FAILURE;
     }
 
-    calc_matrix_dim(file_name, dim);
-    vec_number = dim[0];
-    vec_dim = dim[1];
-
-    if ((d_points = read_file(file_name, vec_number, vec_dim)) == NULL)
+    if (is_binary_matrix_file(file_name))
+    {
+        d_points = map_binary_matrix(file_name, 1);
+    }
+    else
+    {
+        d_points = parse_csv_file(file_name);
+    }
+    if (d_points == NULL)
     {
         printf("An Error Has Occoured");
         return EXIT_FAILURE;
     }
+    vec_number = d_points->rows;
+
+    if (!strcmp(goal, "ddg"))
+    {
+        double *degrees = calc_degree_vector(d_points);
+        free_matrix_memory(d_points);
+        if (degrees == NULL)
+        {
+            printf("An Error Has Occoured");
+            return EXIT_FAILURE;
+        }
+        failed = print_diagonal_matrix(degrees, vec_number);
+        free(degrees);
+        if (failed)
+        {
+            printf("An Error Has Occoured");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (!strcmp(goal, "norm") && get_precision() == PRECISION_MIXED)
+    {
+        PackedFloatMatrix *float_matrix = calc_packed_float_normalized_similarity_matrix(d_points);
+        free_matrix_memory(d_points);
+        if (float_matrix == NULL)
+        {
+            printf("An Error Has Occoured");
+            return EXIT_FAILURE;
+        }
+        failed = print_packed_float_matrix(float_matrix);
+        free_packed_float_matrix(float_matrix);
+        if (failed)
+        {
+            printf("An Error Has Occoured");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
 
-    res_matrix = calc_matrix_by_goal(goal, d_points, vec_number, vec_dim);
-    free_matrix_memory(d_points, vec_number);
+    res_matrix = calc_matrix_by_goal(goal, d_points);
+    free_matrix_memory(d_points);
 
     if (res_matrix == NULL)
     {
@@ -436,7 +5350,12 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    print_matrix(res_matrix, vec_number, vec_number);
-    free_matrix_memory(res_matrix, vec_number);
+    failed = print_packed_matrix(res_matrix);
+    free_packed_matrix(res_matrix);
+    if (failed)
+    {
+        printf("An Error Has Occoured");
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -1,17 +1,227 @@
-void free_matrix_memory(double **matrix, int vNum);
-void print_matrix(double **datapoints, int vNum, int vSize);
-double sum_vector_coordinates(double *v1, int vSize);
-double calculate_squared_euclidean_distance(double *v1, double *v2, int vSize);
-double **calc_similarity_matrix(int vNum, int vSize, double **datapoints);
-double **init_matrix(int vNum, int vSize);
-double **calc_diagonal_matrix(int vNum, int vSize, double **datapoints);
-double **calc_normalized_similarity_matrix(int vNum, int vSize, double **datapoints);
-double **calc_symnmf(int k, int vNum, double **norm_matrix, double **H);
-int has_converged(int k, int vNum, double **H, double **next_h);
-double **get_next_H_matrix(int k, int vNum, double **norm_matrix, double **H);
-double **read_file(const char *file_name, int vNum, int vSize);
+#ifndef SYMNMF_H
+#define SYMNMF_H
+
+#include <stddef.h>
+
+/* Byte alignment of every matrix buffer (one cache line) */
+#define MATRIX_ALIGNMENT 64
+
+/* A dense row-major matrix stored in one contiguous, aligned buffer.
+ * Row i starts at data + i * stride; stride >= cols. When mapping is set, data lies inside a
+ * private file mapping of mapping_bytes that free_matrix_memory unmaps instead of freeing; when
+ * release is set, data belongs to owner and free_matrix_memory hands it back with release(owner). */
+typedef struct
+{
+    double *data;
+    int rows;
+    int cols;
+    int stride;
+    void *mapping;
+    size_t mapping_bytes;
+    void (*release)(void *owner);
+    void *owner;
+} Matrix;
+
+#define MATRIX_ROW(m, i) ((m)->data + (size_t)(i) * (size_t)(m)->stride)
+#define MATRIX_AT(m, i, j) (MATRIX_ROW(m, i)[j])
+
+/* The upper triangle (diagonal included) of a symmetric size x size matrix, packed row by row.
+ * PACKED_ROW(p, i)[j] is entry (i, j) for every j >= i. */
+typedef struct
+{
+    double *data;
+    int size;
+} PackedMatrix;
+
+/* The same packed layout holding single-precision entries */
+typedef struct
+{
+    float *data;
+    int size;
+} PackedFloatMatrix;
+
+#define PACKED_OFFSET(size, i) ((size_t)(i) * (size_t)(size) - (size_t)(i) * ((size_t)(i) + 1) / 2)
+#define PACKED_ROW(p, i) ((p)->data + PACKED_OFFSET((p)->size, i))
+
+/* A symmetric size x size matrix in compressed sparse rows: row i holds the entries
+ * values[row_start[i] .. row_start[i + 1]) in columns cols[...], sorted by column.
+ * Both (i, j) and (j, i) are stored. */
+typedef struct
+{
+    int size;
+    size_t *row_start;
+    int *cols;
+    double *values;
+} SparseMatrix;
+
+/* Storage modes of the normalized similarity matrix W consumed by the SymNMF update */
+#define AFFINITY_DENSE 0
+#define AFFINITY_PACKED 1
+#define AFFINITY_SPARSE 2
+#define AFFINITY_IMPLICIT 3
+#define AFFINITY_DISK 4
+#define AFFINITY_LOWRANK 5
+#define AFFINITY_PACKED_FLOAT 6
+
+/* Storage precision of W: all double (the reference), or W in float with every product,
+ * degree and norm still accumulated in double */
+#define PRECISION_DOUBLE 0
+#define PRECISION_MIXED 1
+
+/* Landmark sampling strategies of the Nystrom approximation */
+#define NYSTROM_UNIFORM 0
+#define NYSTROM_KMEANSPP 1
+
+/* W = D^-1/2 * A * D^-1/2 never stored: its entries are rebuilt from the points whenever W*H is
+ * needed, so only the points and the n scaled degrees d_i^-1/2 are kept, plus the sum of all
+ * entries of W */
+typedef struct
+{
+    const Matrix *d_points;
+    double *inv_sqrt_degrees;
+    double total;
+} ImplicitAffinity;
+
+/* Throughput of a DiskAffinity for the caller to report: the one write of W, then the totals over
+ * every W*H streamed from it */
+typedef struct
+{
+    double bytes_written;
+    double write_seconds;
+    double bytes_read;
+    double io_seconds;
+    double stream_seconds;
+    int passes;
+} DiskStats;
+
+/* W = D^-1/2 * A * D^-1/2 stored in a file as its packed upper triangle, read back in row bands
+ * band_start[b] .. band_start[b + 1] of at most band_capacity doubles each. Products with W keep
+ * their per-thread n x k partial sums within partial_capacity doubles. */
+typedef struct
+{
+    int fd;
+    int size;
+    int num_bands;
+    int *band_start;
+    size_t band_capacity;
+    size_t partial_capacity;
+    double total;
+    DiskStats *stats;
+} DiskAffinity;
+
+/* A rank-r Nystrom approximation W ~ G * G^T - D^-1 with G = D^-1/2 * F (n x r) and the
+ * approximate degrees D; the diagonal term keeps W's diagonal at zero as in the exact matrix */
+typedef struct
+{
+    Matrix *factor;
+    double *degrees;
+    int size;
+} LowRankAffinity;
+
+typedef struct
+{
+    int kind;
+    int size;
+    const Matrix *dense;
+    const PackedMatrix *packed;
+    const SparseMatrix *sparse;
+    const ImplicitAffinity *implicit;
+    const DiskAffinity *disk;
+    const LowRankAffinity *lowrank;
+    const PackedFloatMatrix *packed_float;
+} Affinity;
+
+/* Accuracy modes of exp_block: within 1 ulp of libm, or relative error below 1e-8 */
+#define EXP_STRICT 0
+#define EXP_FAST 1
+
+/* A unit of parallel work; every pool thread runs it once with its own thread_id */
+typedef void (*ParallelTask)(void *arg, int thread_id, int num_threads);
+
+Matrix *init_matrix(int rows, int cols);
+Matrix *wrap_matrix(double *data, int rows, int cols, int stride, void (*release)(void *owner), void *owner);
+void free_matrix_memory(Matrix *matrix);
+PackedMatrix *init_packed_matrix(int size);
+void free_packed_matrix(PackedMatrix *matrix);
+PackedFloatMatrix *init_packed_float_matrix(int size);
+void free_packed_float_matrix(PackedFloatMatrix *matrix);
+SparseMatrix *init_sparse_matrix(int size, size_t nnz);
+void free_sparse_matrix(SparseMatrix *matrix);
+void set_num_threads(int num_threads);
+int get_num_threads(void);
+void parallel_run(ParallelTask task, void *arg);
+const char *get_output_file(void);
+int set_output_file(const char *file_name);
+int print_matrix(const Matrix *matrix);
+int print_packed_matrix(const PackedMatrix *matrix);
+int print_packed_float_matrix(const PackedFloatMatrix *matrix);
+int print_diagonal_matrix(const double *diagonal, int size);
+double sum_vector_coordinates(const double *v1, int vSize);
+double calculate_squared_euclidean_distance(const double *v1, const double *v2, int vSize);
+const char *get_distance_kernel(void);
+double squared_euclidean_distance(const double *v1, const double *v2, int vSize);
+void squared_distances_to_points(const double *point, const Matrix *points, int first, int last, double *out);
+int get_exp_mode(void);
+int set_exp_mode(int mode);
+void exp_block(double *values, int count);
+void gaussian_affinity_block(double *values, int count);
+int get_precision(void);
+void set_precision(int mode);
+Matrix *calc_similarity_matrix(const Matrix *datapoints);
+PackedMatrix *calc_packed_similarity_matrix(const Matrix *datapoints);
+double *calc_row_sums(const Matrix *matrix);
+double *calc_packed_row_sums(const PackedMatrix *matrix);
+double *calc_degree_vector(const Matrix *datapoints);
+Matrix *calc_diagonal_matrix(const Matrix *datapoints);
+PackedMatrix *calc_packed_diagonal_matrix(const Matrix *datapoints);
+int normalize_similarity_matrix(Matrix *A, const double *degrees);
+Matrix *calc_normalized_similarity_matrix(const Matrix *datapoints);
+int normalize_packed_similarity_matrix(PackedMatrix *A, const double *degrees);
+PackedMatrix *calc_packed_normalized_similarity_matrix(const Matrix *datapoints);
+PackedFloatMatrix *calc_packed_float_normalized_similarity_matrix(const Matrix *datapoints);
+SparseMatrix *calc_knn_similarity_matrix(const Matrix *datapoints, int neighbors);
+double *calc_sparse_row_sums(const SparseMatrix *matrix);
+int normalize_sparse_similarity_matrix(SparseMatrix *A, const double *degrees);
+SparseMatrix *calc_knn_normalized_similarity_matrix(const Matrix *datapoints, int neighbors);
+SparseMatrix *calc_radius_similarity_matrix(const Matrix *datapoints, double tolerance);
+SparseMatrix *calc_radius_normalized_similarity_matrix(const Matrix *datapoints, double tolerance);
+ImplicitAffinity *init_implicit_affinity(const Matrix *datapoints);
+void free_implicit_affinity(ImplicitAffinity *affinity);
+DiskAffinity *write_disk_affinity(const Matrix *datapoints, const char *path, size_t memory_budget);
+void free_disk_affinity(DiskAffinity *disk);
+LowRankAffinity *calc_nystrom_affinity(const Matrix *datapoints, int landmarks, int method, unsigned long seed);
+double nystrom_sample_error(const LowRankAffinity *affinity, const Matrix *datapoints, int samples, unsigned long seed,
+                            double *max_error);
+double lowrank_affinity_mean(const LowRankAffinity *affinity);
+void free_lowrank_affinity(LowRankAffinity *affinity);
+Matrix *calc_symnmf(const Matrix *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_packed(const PackedMatrix *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_sparse(const SparseMatrix *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_implicit(const ImplicitAffinity *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_disk(const DiskAffinity *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_lowrank(const LowRankAffinity *norm_matrix, Matrix *H);
+Matrix *calc_symnmf_packed_float(const PackedFloatMatrix *norm_matrix, Matrix *H);
+void scale_initial_h(Matrix *H, double mean, int k);
+Matrix *calc_symnmf_affinity(const Affinity *W, Matrix *H);
+Matrix *init_symnmf_h(int n, int k, double mean_w, unsigned long seed);
+Matrix *fit_symnmf(const Matrix *datapoints, int k, unsigned long seed);
+void calc_labels(const Matrix *H, int *labels);
+int has_converged(const Matrix *H, const Matrix *next_h);
+Matrix *calc_gram_matrix(const Matrix *H);
+int affinity_times_matrix(const Affinity *W, const Matrix *H, Matrix *WH);
+Matrix *get_next_H_matrix(const Affinity *W, const Matrix *H);
+Matrix *parse_csv_file(const char *file_name);
+Matrix *read_file(const char *file_name, int vNum, int vSize);
 void calc_matrix_dim(char *file_name, int *dim);
-double **matrix_multiplication(double **matrix1, double **matrix2, int rows1, int cols1, int cols2);
-double **calc_matrix_transpose(double **matrix, int vNum, int vSize);
-void make_copy(double **targetMatrix, double **baseMatrix, int rows, int cols);
-double **calc_matrix_by_goal(char *goal, double **datapoints, int vNum, int vSize);
\ No newline at end of file
+int is_binary_matrix_file(const char *file_name);
+int write_binary_matrix(const Matrix *matrix, const char *file_name);
+Matrix *map_binary_matrix(const char *file_name, int verify);
+int convert_to_binary(const char *csv_name, const char *binary_name);
+int gemm(int trans_a, int trans_b, const Matrix *A, const Matrix *B, Matrix *C, int accumulate);
+Matrix *matrix_multiplication(const Matrix *matrix1, const Matrix *matrix2);
+Matrix *matrix_multiplication_tn(const Matrix *matrix1, const Matrix *matrix2);
+Matrix *matrix_multiplication_nt(const Matrix *matrix1, const Matrix *matrix2);
+void make_a_copy(Matrix *dest, const Matrix *src);
+PackedMatrix *calc_matrix_by_goal(char *goal, const Matrix *datapoints);
+
+#endif
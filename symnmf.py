@@ -1,5 +1,6 @@
+import os
 import sys
-from math import sqrt
+import tempfile
 import numpy as np
 import symnmfmodule
 
@@ -10,36 +11,71 @@ def to_number(num):
         raise Exception()
 
 def init_vector_list(input_data):
-    vectors = []
-    with open(input_data) as vectors_file:
-        for line in vectors_file:
-            vector = line.strip()
-            if vector:
-                vectors.append(list(float(point) for point in vector.split(",")))
-    return vectors
+    return np.asarray(symnmfmodule.read_csv(input_data))
 
 def parse_input():
     k = to_number(sys.argv[1])
     goal = sys.argv[2]
     input_data = sys.argv[3]
+    sparsity = sys.argv[4] if len(sys.argv) > 4 else 0
+    if sparsity == "disk":
+        sparsity = ("disk", float(sys.argv[5]) if len(sys.argv) > 5 else 256.0)
+    elif sparsity == "nystrom":
+        sparsity = ("nystrom", int(sys.argv[5]) if len(sys.argv) > 5 else 100,
+                    sys.argv[6] if len(sys.argv) > 6 else "kmeans++")
+    elif sparsity != "implicit":
+        sparsity = float(sparsity)
 
+    # binary files are handed to C by path and mapped there instead of parsed here
+    shape = symnmfmodule.binary_shape(input_data)
+    if shape is not None:
+        n, d = shape
+        return input_data, k, goal, n, d, sparsity
     d_points = init_vector_list(input_data)
-    n = len(d_points)
-    d = len(d_points[0])
-    return d_points, k, goal, n, d
+    n, d = d_points.shape
+    return d_points, k, goal, n, d, sparsity
 
-def init_h(n, k, W):
+def rate(num_bytes, seconds):
+    return num_bytes / 1e9 / seconds if seconds > 0 else 0.0
+
+def report_disk(stats):
+    sys.stderr.write("disk affinity: wrote %.3f GB in %d bands, %.3f s (%.2f GB/s)\n"
+                     % (stats["bytes_written"] / 1e9, stats["bands"], stats["write_seconds"],
+                        rate(stats["bytes_written"], stats["write_seconds"])))
+    sys.stderr.write("disk affinity: read %.3f GB in %d passes, %.3f s of I/O (%.2f GB/s), %.3f s streaming (%.2f GB/s)\n"
+                     % (stats["bytes_read"] / 1e9, stats["passes"], stats["io_seconds"],
+                        rate(stats["bytes_read"], stats["io_seconds"]), stats["stream_seconds"],
+                        rate(stats["bytes_read"], stats["stream_seconds"])))
+
+def init_unit_h(n, k):
     np.random.seed(0)
-    mean_w = np.mean(W)
-    constant_term = 2 * sqrt(mean_w / k)
-    H = np.random.uniform(0, high=constant_term, size=(n, k))
-    return H.tolist()
-
-def logic(d_points, k, goal, n, d):
-    if goal == "symnmf":
-        W = symnmfmodule.norm(0, n, d ,d_points)
-        H = init_h(n, k, W)
-        symnmfmodule.symnmf(k, n, W, H, 0)
+    return np.random.uniform(0, high=1.0, size=(n, k))
+
+# sparsity >= 1 keeps that many nearest neighbors per point; 0 < sparsity < 1 keeps every
+# affinity of at least that value; "implicit" never stores W; "disk [MB]" streams W from a
+# temporary file through that much memory; "nystrom [m] [uniform|kmeans++]" approximates W
+# from m landmark points
+def logic(d_points, k, goal, n, d, sparsity=0):
+    if goal == "symnmf" and isinstance(sparsity, tuple) and sparsity[0] == "nystrom":
+        _, stats = symnmfmodule.nystrom_symnmf(k, n, d, d_points, sparsity[1], sparsity[2], init_unit_h(n, k), 0, True)
+        sys.stderr.write("nystrom: rank %d of %d landmarks, sampled affinity error rms %.3e relative, max %.3e\n"
+                         % (stats["rank"], stats["landmarks"], stats["rms_error"], stats["max_error"]))
+    elif goal == "symnmf" and isinstance(sparsity, tuple):
+        fd, path = tempfile.mkstemp(suffix=".symnmfw", dir=".")
+        os.close(fd)
+        try:
+            _, stats = symnmfmodule.disk_symnmf(k, n, d, d_points, path, sparsity[1], init_unit_h(n, k), 0, True)
+            report_disk(stats)
+        finally:
+            os.remove(path)
+    elif goal == "symnmf" and sparsity == "implicit":
+        symnmfmodule.implicit_symnmf(k, n, d, d_points, init_unit_h(n, k), 0)
+    elif goal == "symnmf" and sparsity >= 1:
+        symnmfmodule.knn_symnmf(k, n, d, d_points, int(sparsity), init_unit_h(n, k), 0)
+    elif goal == "symnmf" and sparsity > 0:
+        symnmfmodule.radius_symnmf(k, n, d, d_points, sparsity, init_unit_h(n, k), 0)
+    elif goal == "symnmf":
+        symnmfmodule.fit(k, n, d, d_points, "print", 0)
     elif goal == "similarity_matrix":
         symnmfmodule.similarity_matrix(n, d, d_points)
     elif goal == "diagonal_matrix":
@@ -51,8 +87,8 @@ def logic(d_points, k, goal, n, d):
 
 def main():
     try:
-        d_points, k, goal, n, d = parse_input()
-        logic(d_points, k, goal, n, d)
+        d_points, k, goal, n, d, sparsity = parse_input()
+        logic(d_points, k, goal, n, d, sparsity)
     except Exception as e:
         print("An Error Has Occurred")
 
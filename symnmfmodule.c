@@ -3,43 +3,261 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 #include "symnmf.h"
 
-static double **matrix_parse(PyObject *X, int rows, int cols)
+/* Results are handed to Python as SymnmfMatrix objects: the C Matrix itself, exported through the
+ * buffer protocol as a rows x cols float64 array, so numpy.asarray() views it without a copy */
+typedef struct
 {
-    double **matrix = (double **)malloc(rows * sizeof(double *));
-    int i, j, k;
+    PyObject_HEAD
+    Matrix *matrix;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} SymnmfMatrix;
+
+static void symnmf_matrix_dealloc(SymnmfMatrix *self)
+{
+    free_matrix_memory(self->matrix);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int symnmf_matrix_getbuffer(SymnmfMatrix *self, Py_buffer *view, int flags)
+{
+    Matrix *matrix = self->matrix;
+    int contiguous = (flags & PyBUF_C_CONTIGUOUS) == PyBUF_C_CONTIGUOUS ||
+                     (flags & PyBUF_ANY_CONTIGUOUS) == PyBUF_ANY_CONTIGUOUS;
+    if ((flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS && matrix->rows > 1 && matrix->cols > 1)
+    {
+        PyErr_SetString(PyExc_BufferError, "Matrix is row-major");
+        return -1;
+    }
+    if (((flags & PyBUF_STRIDES) != PyBUF_STRIDES || contiguous) && matrix->stride != matrix->cols && matrix->rows > 1)
+    {
+        PyErr_SetString(PyExc_BufferError, "Matrix rows are padded; request a strided buffer");
+        return -1;
+    }
+
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = matrix->data;
+    view->len = (Py_ssize_t)matrix->rows * matrix->cols * (Py_ssize_t)sizeof(double);
+    view->readonly = 0;
+    view->itemsize = sizeof(double);
+    view->format = (flags & PyBUF_FORMAT) ? "d" : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyObject *symnmf_matrix_shape(SymnmfMatrix *self, void *closure)
+{
+    return Py_BuildValue("(ii)", self->matrix->rows, self->matrix->cols);
+}
+
+static PyBufferProcs symnmf_matrix_buffer = {(getbufferproc)symnmf_matrix_getbuffer, NULL};
+
+static PyGetSetDef symnmf_matrix_getset[] = {
+    {"shape", (getter)symnmf_matrix_shape, NULL, "(rows, cols)", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyTypeObject SymnmfMatrixType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "symnmfmodule.Matrix",
+    .tp_basicsize = sizeof(SymnmfMatrix),
+    .tp_dealloc = (destructor)symnmf_matrix_dealloc,
+    .tp_as_buffer = &symnmf_matrix_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "A float64 matrix owned by the C extension, readable through the buffer protocol",
+    .tp_getset = symnmf_matrix_getset,
+};
+
+/* Wraps matrix in a SymnmfMatrix, which takes ownership of it (it is freed on failure too) */
+static PyObject *build_mat_Python(Matrix *matrix)
+{
+    SymnmfMatrix *result = PyObject_New(SymnmfMatrix, &SymnmfMatrixType);
+    if (!result)
+    {
+        free_matrix_memory(matrix);
+        return NULL;
+    }
+    result->matrix = matrix;
+    result->shape[0] = matrix->rows;
+    result->shape[1] = matrix->cols;
+    result->strides[0] = (Py_ssize_t)matrix->stride * (Py_ssize_t)sizeof(double);
+    result->strides[1] = sizeof(double);
+    return (PyObject *)result;
+}
+
+/* None after a print, or OSError when the output could not be written */
+static PyObject *printed(int failed)
+{
+    if (failed)
+    {
+        PyErr_SetString(PyExc_OSError, "Failed to write the output");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* The factor for analysis, owned by the returned object; otherwise it is printed and freed with
+ * the GIL released */
+static PyObject *symnmf_result(Matrix *symnmf_matrix, int analysis)
+{
+    int failed;
+    if (analysis)
+    {
+        return build_mat_Python(symnmf_matrix);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    failed = print_matrix(symnmf_matrix);
+    free_matrix_memory(symnmf_matrix);
+    Py_END_ALLOW_THREADS
+    return printed(failed);
+}
+
+/* Hands an exported buffer back once the Matrix viewing it is freed */
+static void release_view(void *owner)
+{
+    PyBuffer_Release((Py_buffer *)owner);
+    PyMem_Free(owner);
+}
+
+/* 'd' or 'f' for a native float64 or float32 buffer, 0 for anything else */
+static char buffer_type(const Py_buffer *view)
+{
+    const char *format = view->format ? view->format : "B";
+    if (*format == '@' || *format == '=')
+    {
+        format++;
+    }
+    if (format[0] == 'd' && format[1] == '\0' && view->itemsize == sizeof(double))
+        return 'd';
+    if (format[0] == 'f' && format[1] == '\0' && view->itemsize == sizeof(float))
+        return 'f';
+    return 0;
+}
+
+#define BUFFER_AT(view, type, i, j) \
+    (*(const type *)((const char *)(view)->buf + (i) * (view)->strides[0] + (j) * (view)->strides[1]))
+
+/* Gets a rows x cols float64/float32 buffer of X. Returns 'd' or 'f', or 0 with an exception set
+ * (and nothing to release). */
+static char buffer_get(PyObject *X, Py_buffer *view, int rows, int cols)
+{
+    char type;
+    if (PyObject_GetBuffer(X, view, PyBUF_STRIDES | PyBUF_FORMAT) != 0)
+    {
+        return 0;
+    }
+    type = buffer_type(view);
+    if (!type || view->ndim != 2 || view->shape[0] != rows || view->shape[1] != cols)
+    {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_ValueError, "Expected a %d x %d float64 or float32 array", rows, cols);
+        return 0;
+    }
+    return type;
+}
+
+/* A float64 buffer whose rows are contiguous is used in place and stays exported until the Matrix
+ * is freed; any other buffer, or one the caller will overwrite (copy set), is converted */
+static Matrix *buffer_parse(PyObject *X, int rows, int cols, int copy)
+{
+    Py_buffer *view = PyMem_Malloc(sizeof(Py_buffer));
+    if (!view)
+        return (Matrix *)PyErr_NoMemory();
+    char type = buffer_get(X, view, rows, cols);
+    if (!type)
+    {
+        PyMem_Free(view);
+        return NULL;
+    }
+
+    Py_ssize_t row_stride = rows > 1 ? view->strides[0] : (Py_ssize_t)cols * (Py_ssize_t)sizeof(double);
+    if (!copy && type == 'd' && (cols <= 1 || view->strides[1] == sizeof(double)) &&
+        row_stride % (Py_ssize_t)sizeof(double) == 0 && row_stride >= (Py_ssize_t)cols * (Py_ssize_t)sizeof(double) &&
+        row_stride / (Py_ssize_t)sizeof(double) <= INT_MAX)
+    {
+        Matrix *matrix = wrap_matrix((double *)view->buf, rows, cols, (int)(row_stride / (Py_ssize_t)sizeof(double)),
+                                     release_view, view);
+        if (!matrix)
+        {
+            release_view(view);
+            PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for matrix");
+        }
+        return matrix;
+    }
+
+    Matrix *matrix = init_matrix(rows, cols);
+    int i, j;
     if (!matrix)
     {
+        release_view(view);
         PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for matrix");
         return NULL;
     }
-
     for (i = 0; i < rows; ++i)
     {
-        matrix[i] = (double *)malloc(cols * sizeof(double));
-        if (!matrix[i])
+        double *matrix_row = MATRIX_ROW(matrix, i);
+        for (j = 0; j < cols; ++j)
         {
-            for (j = 0; j < i; ++j)
-            {
-                free(matrix[j]);
-            }
-            free(matrix);
-            PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for matrix row");
+            matrix_row[j] = type == 'd' ? BUFFER_AT(view, double, i, j) : BUFFER_AT(view, float, i, j);
+        }
+    }
+    release_view(view);
+    return matrix;
+}
+
+/* X is a list of rows, an object exporting a float64/float32 buffer (a NumPy array), or the path
+ * of a binary data-point file, which is checked against its checksum, then mapped and used in
+ * place. With copy set the result is always private storage the caller may overwrite. */
+static Matrix *matrix_parse(PyObject *X, int rows, int cols, int copy)
+{
+    if (PyUnicode_Check(X))
+    {
+        const char *path = PyUnicode_AsUTF8(X);
+        Matrix *mapped = path ? map_binary_matrix(path, 1) : NULL;
+        if (!mapped)
+        {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "Failed to map the binary data-point file");
+            return NULL;
+        }
+        if (mapped->rows != rows || mapped->cols != cols)
+        {
+            free_matrix_memory(mapped);
+            PyErr_SetString(PyExc_ValueError, "Binary data-point file does not match the given dimensions");
             return NULL;
         }
+        return mapped;
+    }
+    if (PyObject_CheckBuffer(X))
+    {
+        return buffer_parse(X, rows, cols, copy);
+    }
 
+    Matrix *matrix = init_matrix(rows, cols);
+    int i, j;
+    if (!matrix)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for matrix");
+        return NULL;
+    }
+
+    for (i = 0; i < rows; ++i)
+    {
         PyObject *row = PyList_GetItem(X, i);
+        double *matrix_row = MATRIX_ROW(matrix, i);
         for (j = 0; j < cols; ++j)
         {
-            matrix[i][j] = PyFloat_AsDouble(PyList_GetItem(row, j));
+            matrix_row[j] = PyFloat_AsDouble(PyList_GetItem(row, j));
             if (PyErr_Occurred())
             {
-                for (k = 0; k <= i; ++k)
-                {
-                    free(matrix[k]);
-                }
-                free(matrix);
+                free_matrix_memory(matrix);
                 return NULL;
             }
         }
@@ -47,36 +265,74 @@ static double **matrix_parse(PyObject *X, int rows, int cols)
     return matrix;
 }
 
-static PyObject *build_mat_Python(double **matrix, int rows, int cols)
+/* Reads only the upper triangle of a symmetric list-of-lists matrix */
+static PackedMatrix *packed_parse(PyObject *X, int size)
 {
-    PyObject *py_matrix = PyList_New(rows);
+    PackedMatrix *matrix = init_packed_matrix(size);
     int i, j;
-    if (!py_matrix)
+    if (!matrix)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for matrix");
         return NULL;
+    }
 
-    for (i = 0; i < rows; ++i)
+    for (i = 0; i < size; ++i)
     {
-        PyObject *row = PyList_New(cols);
-        if (!row)
+        PyObject *row = PyList_GetItem(X, i);
+        double *matrix_row = PACKED_ROW(matrix, i);
+        for (j = i; j < size; ++j)
         {
-            Py_DECREF(py_matrix);
-            return NULL;
+            matrix_row[j] = PyFloat_AsDouble(PyList_GetItem(row, j));
+            if (PyErr_Occurred())
+            {
+                free_packed_matrix(matrix);
+                return NULL;
+            }
         }
+    }
+    return matrix;
+}
 
-        for (j = 0; j < cols; ++j)
+/* The upper triangle of a symmetric list-of-lists or float64/float32 buffer matrix in float */
+static PackedFloatMatrix *packed_float_parse(PyObject *X, int size)
+{
+    PackedFloatMatrix *matrix = init_packed_float_matrix(size);
+    Py_buffer view;
+    char type = 0;
+    int i, j;
+    if (!matrix)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for matrix");
+        return NULL;
+    }
+    if (PyObject_CheckBuffer(X) && !(type = buffer_get(X, &view, size, size)))
+    {
+        free_packed_float_matrix(matrix);
+        return NULL;
+    }
+
+    for (i = 0; i < size; ++i)
+    {
+        PyObject *row = type ? NULL : PyList_GetItem(X, i);
+        float *matrix_row = PACKED_ROW(matrix, i);
+        for (j = i; j < size; ++j)
         {
-            PyObject *val = PyFloat_FromDouble(matrix[i][j]);
-            if (!val)
+            if (type)
             {
-                Py_DECREF(row);
-                Py_DECREF(py_matrix);
+                matrix_row[j] = type == 'f' ? BUFFER_AT(&view, float, i, j) : (float)BUFFER_AT(&view, double, i, j);
+                continue;
+            }
+            matrix_row[j] = (float)PyFloat_AsDouble(PyList_GetItem(row, j));
+            if (PyErr_Occurred())
+            {
+                free_packed_float_matrix(matrix);
                 return NULL;
             }
-            PyList_SET_ITEM(row, j, val);
         }
-        PyList_SET_ITEM(py_matrix, i, row);
     }
-    return py_matrix;
+    if (type)
+        PyBuffer_Release(&view);
+    return matrix;
 }
 
 static PyObject *similarity_matrix(PyObject *self, PyObject *args)
@@ -89,23 +345,27 @@ static PyObject *similarity_matrix(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    double **vectors = matrix_parse(X, vec_number, vec_dim);
+    Matrix *vectors = matrix_parse(X, vec_number, vec_dim, 0);
     if (!vectors)
         return NULL;
 
-    double **sym_matrix = calc_similarity_matrix(vec_number, vec_dim, vectors);
+    PackedMatrix *sym_matrix;
+    int failed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    sym_matrix = calc_packed_similarity_matrix(vectors);
+    if (sym_matrix)
+    {
+        failed = print_packed_matrix(sym_matrix);
+        free_packed_matrix(sym_matrix);
+    }
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(vectors);
     if (!sym_matrix)
     {
-        free_matrix_memory(vectors, vec_number);
         PyErr_SetString(PyExc_RuntimeError, "Failed to create similarity matrix");
         return NULL;
     }
-
-    print_matrix(sym_matrix, vec_number, vec_number);
-    free_matrix_memory(vectors, vec_number);
-    free_matrix_memory(sym_matrix, vec_number);
-
-    Py_RETURN_NONE;
+    return printed(failed);
 }
 
 static PyObject *diagonal_matrix(PyObject *self, PyObject *args)
@@ -118,23 +378,62 @@ static PyObject *diagonal_matrix(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    double **vectors = matrix_parse(X, vec_number, vec_dim);
+    Matrix *vectors = matrix_parse(X, vec_number, vec_dim, 0);
     if (!vectors)
         return NULL;
 
-    double **ddg_matrix = calc_diagonal_matrix(vec_number, vec_dim, vectors);
-    if (!ddg_matrix)
+    double *degrees;
+    int failed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    degrees = calc_degree_vector(vectors);
+    if (degrees)
+    {
+        failed = print_diagonal_matrix(degrees, vec_number);
+        free(degrees);
+    }
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(vectors);
+    if (!degrees)
     {
-        free_matrix_memory(vectors, vec_number);
         PyErr_SetString(PyExc_RuntimeError, "Failed to create diagonal matrix");
         return NULL;
     }
+    return printed(failed);
+}
 
-    print_matrix(ddg_matrix, vec_number, vec_number);
-    free_matrix_memory(vectors, vec_number);
-    free_matrix_memory(ddg_matrix, vec_number);
+/* The degrees as an n x 1 Matrix object over the array calc_degree_vector returned, no copy */
+static PyObject *degree_vector(PyObject *self, PyObject *args)
+{
+    int vec_number, vec_dim;
+    PyObject *X;
 
-    Py_RETURN_NONE;
+    if (!PyArg_ParseTuple(args, "iiO", &vec_number, &vec_dim, &X))
+    {
+        return NULL;
+    }
+
+    Matrix *vectors = matrix_parse(X, vec_number, vec_dim, 0);
+    if (!vectors)
+        return NULL;
+
+    double *degrees;
+    Py_BEGIN_ALLOW_THREADS
+    degrees = calc_degree_vector(vectors);
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(vectors);
+    if (!degrees)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to compute degree vector");
+        return NULL;
+    }
+
+    Matrix *matrix = wrap_matrix(degrees, vec_number, 1, 1, free, degrees);
+    if (!matrix)
+    {
+        free(degrees);
+        return PyErr_NoMemory();
+    }
+    return build_mat_Python(matrix);
 }
 
 static PyObject *norm_matrix(PyObject *self, PyObject *args)
@@ -147,105 +446,687 @@ static PyObject *norm_matrix(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    double **vectors = matrix_parse(X, vec_number, vec_dim);
+    Matrix *vectors = matrix_parse(X, vec_number, vec_dim, 0);
     if (!vectors)
         return NULL;
 
-    double **norm_matrix = calc_normalized_similarity_matrix(vec_number, vec_dim, vectors);
+    /* Printing needs only the packed triangle; a returned W is the full matrix Python reads in place */
+    if (!need_to_print)
+    {
+        Matrix *dense_matrix;
+        Py_BEGIN_ALLOW_THREADS
+        dense_matrix = calc_normalized_similarity_matrix(vectors);
+        Py_END_ALLOW_THREADS
+        free_matrix_memory(vectors);
+        if (!dense_matrix)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to normalize similarity matrix");
+            return NULL;
+        }
+        return build_mat_Python(dense_matrix);
+    }
+
+    PackedMatrix *norm_matrix;
+    int failed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    norm_matrix = calc_packed_normalized_similarity_matrix(vectors);
+    if (norm_matrix)
+    {
+        failed = print_packed_matrix(norm_matrix);
+        free_packed_matrix(norm_matrix);
+    }
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(vectors);
     if (!norm_matrix)
     {
-        free_matrix_memory(vectors, vec_number);
         PyErr_SetString(PyExc_RuntimeError, "Failed to normalize similarity matrix");
         return NULL;
     }
+    return printed(failed);
+}
 
-    PyObject *py_norm_matrix = NULL;
-    if (need_to_print)
+static PyObject *symnmf(PyObject *self, PyObject *args)
+{
+    int vec_number, k, analysis;
+    PyObject *H, *W;
+
+    if (!PyArg_ParseTuple(args, "iiOOi", &k, &vec_number, &W, &H, &analysis))
     {
-        print_matrix(norm_matrix, vec_number, vec_number);
+        return NULL;
     }
+
+    Matrix *H_matrix = matrix_parse(H, vec_number, k, 1);
+    if (!H_matrix)
+        return NULL;
+
+    /* Under PRECISION_MIXED W is kept in float; the solve still accumulates in double. A float64
+     * buffer W is used in place as a dense matrix, a list is packed. */
+    Matrix *dense_matrix = NULL;
+    PackedMatrix *norm_matrix = NULL;
+    PackedFloatMatrix *float_matrix = NULL;
+    if (get_precision() == PRECISION_MIXED)
+        float_matrix = packed_float_parse(W, vec_number);
+    else if (PyObject_CheckBuffer(W))
+        dense_matrix = matrix_parse(W, vec_number, vec_number, 0);
     else
+        norm_matrix = packed_parse(W, vec_number);
+    if (!dense_matrix && !norm_matrix && !float_matrix)
     {
-        py_norm_matrix = build_mat_Python(norm_matrix, vec_number, vec_number);
+        free_matrix_memory(H_matrix);
+        return NULL;
     }
 
-    free_matrix_memory(vectors, vec_number);
-    free_matrix_memory(norm_matrix, vec_number);
+    Matrix *symnmf_matrix;
+    Py_BEGIN_ALLOW_THREADS
+    symnmf_matrix = float_matrix ? calc_symnmf_packed_float(float_matrix, H_matrix)
+                    : dense_matrix ? calc_symnmf(dense_matrix, H_matrix)
+                                   : calc_symnmf_packed(norm_matrix, H_matrix);
+    Py_END_ALLOW_THREADS
+    free_packed_float_matrix(float_matrix);
+    free_matrix_memory(dense_matrix);
+    if (!symnmf_matrix)
+    {
+        free_matrix_memory(H_matrix);
+        free_packed_matrix(norm_matrix);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to calculate SYMNMF");
+        return NULL;
+    }
+
+    free_matrix_memory(H_matrix);
+    free_packed_matrix(norm_matrix);
+    return symnmf_result(symnmf_matrix, analysis);
+}
+
+/* SymNMF on a sparse normalized W, which it frees. H0 holds U(0, 1) draws that are scaled here
+ * by 2 * sqrt(mean(W) / k), the same initialization symnmf.py applies to a dense W. */
+static PyObject *sparse_symnmf(SparseMatrix *norm_matrix, Matrix *H_matrix, int k, int analysis)
+{
+    int vec_number = norm_matrix->size;
+    size_t e;
+    double mean = 0.0;
+    Matrix *symnmf_matrix;
 
-    if (need_to_print)
+    Py_BEGIN_ALLOW_THREADS
+    for (e = 0; e < norm_matrix->row_start[vec_number]; e++)
     {
-        Py_RETURN_NONE;
+        mean += norm_matrix->values[e];
     }
-    else
+    scale_initial_h(H_matrix, mean / ((double)vec_number * vec_number), k);
+
+    symnmf_matrix = calc_symnmf_sparse(norm_matrix, H_matrix);
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(H_matrix);
+    free_sparse_matrix(norm_matrix);
+    if (!symnmf_matrix)
     {
-        return py_norm_matrix;
+        PyErr_SetString(PyExc_RuntimeError, "Failed to calculate SYMNMF");
+        return NULL;
     }
+
+    return symnmf_result(symnmf_matrix, analysis);
 }
 
-static PyObject *symnmf(PyObject *self, PyObject *args)
+/* SymNMF on the kNN affinity graph of X */
+static PyObject *knn_symnmf(PyObject *self, PyObject *args)
 {
-    int vec_number, k, analysis;
-    PyObject *H, *W;
+    int vec_number, vec_dim, k, neighbors, analysis;
+    PyObject *X, *H0;
 
-    if (!PyArg_ParseTuple(args, "iiOOi", &k, &vec_number, &W, &H, &analysis))
+    if (!PyArg_ParseTuple(args, "iiiOiOi", &k, &vec_number, &vec_dim, &X, &neighbors, &H0, &analysis))
     {
         return NULL;
     }
 
-    double **H_matrix = matrix_parse(H, vec_number, k);
+    Matrix *d_points = matrix_parse(X, vec_number, vec_dim, 0);
+    if (!d_points)
+        return NULL;
+
+    Matrix *H_matrix = matrix_parse(H0, vec_number, k, 1);
     if (!H_matrix)
+    {
+        free_matrix_memory(d_points);
         return NULL;
+    }
 
-    double **norm_matrix = matrix_parse(W, vec_number, vec_number);
+    SparseMatrix *norm_matrix;
+    Py_BEGIN_ALLOW_THREADS
+    norm_matrix = calc_knn_normalized_similarity_matrix(d_points, neighbors);
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(d_points);
     if (!norm_matrix)
     {
-        free_matrix_memory(H_matrix, vec_number);
+        free_matrix_memory(H_matrix);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to calculate kNN normalized similarity matrix");
+        return NULL;
+    }
+    return sparse_symnmf(norm_matrix, H_matrix, k, analysis);
+}
+
+/* SymNMF on the affinities of X that are at least tolerance, found with a KD-tree */
+static PyObject *radius_symnmf(PyObject *self, PyObject *args)
+{
+    int vec_number, vec_dim, k, analysis;
+    double tolerance;
+    PyObject *X, *H0;
+
+    if (!PyArg_ParseTuple(args, "iiiOdOi", &k, &vec_number, &vec_dim, &X, &tolerance, &H0, &analysis))
+    {
         return NULL;
     }
 
-    double **symnmf_matrix = calc_symnmf(k, vec_number, norm_matrix, H_matrix);
+    Matrix *d_points = matrix_parse(X, vec_number, vec_dim, 0);
+    if (!d_points)
+        return NULL;
+
+    Matrix *H_matrix = matrix_parse(H0, vec_number, k, 1);
+    if (!H_matrix)
+    {
+        free_matrix_memory(d_points);
+        return NULL;
+    }
+
+    SparseMatrix *norm_matrix;
+    Py_BEGIN_ALLOW_THREADS
+    norm_matrix = calc_radius_normalized_similarity_matrix(d_points, tolerance);
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(d_points);
+    if (!norm_matrix)
+    {
+        free_matrix_memory(H_matrix);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to calculate radius normalized similarity matrix");
+        return NULL;
+    }
+    return sparse_symnmf(norm_matrix, H_matrix, k, analysis);
+}
+
+/* SymNMF with W rebuilt from X on every product; memory stays O(n * (d + k)). mean(W) for the
+ * initial scale of H0 is the total kept by init_implicit_affinity. */
+static PyObject *implicit_symnmf(PyObject *self, PyObject *args)
+{
+    int vec_number, vec_dim, k, analysis;
+    PyObject *X, *H0;
+
+    if (!PyArg_ParseTuple(args, "iiiOOi", &k, &vec_number, &vec_dim, &X, &H0, &analysis))
+    {
+        return NULL;
+    }
+
+    Matrix *d_points = matrix_parse(X, vec_number, vec_dim, 0);
+    if (!d_points)
+        return NULL;
+
+    Matrix *H_matrix = matrix_parse(H0, vec_number, k, 1);
+    ImplicitAffinity *norm_matrix = NULL;
+    Matrix *symnmf_matrix = NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    norm_matrix = H_matrix ? init_implicit_affinity(d_points) : NULL;
+    if (norm_matrix)
+    {
+        scale_initial_h(H_matrix, norm_matrix->total / ((double)vec_number * vec_number), k);
+        symnmf_matrix = calc_symnmf_implicit(norm_matrix, H_matrix);
+    }
+    Py_END_ALLOW_THREADS
+
+    free_implicit_affinity(norm_matrix);
+    free_matrix_memory(H_matrix);
+    free_matrix_memory(d_points);
+    if (!norm_matrix)
+    {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Failed to prepare the implicit normalized similarity matrix");
+        return NULL;
+    }
     if (!symnmf_matrix)
     {
-        free_matrix_memory(H_matrix, vec_number);
-        free_matrix_memory(norm_matrix, vec_number);
         PyErr_SetString(PyExc_RuntimeError, "Failed to calculate SYMNMF");
         return NULL;
     }
 
-    PyObject *result = NULL;
-    if (analysis)
+    return symnmf_result(symnmf_matrix, analysis);
+}
+
+/* Pairs a solver result with the figures it was asked to report; steals both references */
+static PyObject *with_report(PyObject *result, PyObject *report)
+{
+    if (!result || !report)
     {
-        result = build_mat_Python(symnmf_matrix, vec_number, k);
+        Py_XDECREF(result);
+        Py_XDECREF(report);
+        return NULL;
     }
-    else
+    return Py_BuildValue("(NN)", result, report);
+}
+
+/* SymNMF with W written once to path and streamed back within memory_mb: half for the two W band
+ * buffers, half for the per-thread partial sums of each product (fewer threads when tight).
+ * With report set the result comes back as (result, stats) with the write and read throughput. */
+static PyObject *disk_symnmf(PyObject *self, PyObject *args)
+{
+    int vec_number, vec_dim, k, analysis, report = 0;
+    double memory_mb;
+    const char *path;
+    PyObject *X, *H0, *stats;
+
+    if (!PyArg_ParseTuple(args, "iiiOsdOi|p", &k, &vec_number, &vec_dim, &X, &path, &memory_mb, &H0, &analysis,
+                          &report))
+    {
+        return NULL;
+    }
+
+    Matrix *d_points = matrix_parse(X, vec_number, vec_dim, 0);
+    if (!d_points)
+        return NULL;
+
+    Matrix *H_matrix = matrix_parse(H0, vec_number, k, 1);
+    DiskAffinity *norm_matrix = NULL;
+    Matrix *symnmf_matrix = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    norm_matrix = H_matrix ? write_disk_affinity(d_points, path, (size_t)(memory_mb * 1024 * 1024)) : NULL;
+    if (norm_matrix)
+    {
+        scale_initial_h(H_matrix, norm_matrix->total / ((double)vec_number * vec_number), k);
+        symnmf_matrix = calc_symnmf_disk(norm_matrix, H_matrix);
+    }
+    Py_END_ALLOW_THREADS
+
+    free_matrix_memory(d_points);
+    free_matrix_memory(H_matrix);
+    if (!norm_matrix)
+    {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Failed to write the normalized similarity matrix to disk");
+        return NULL;
+    }
+    const DiskStats *disk_stats = norm_matrix->stats;
+    stats = !report ? NULL
+                    : Py_BuildValue("{s:d,s:d,s:i,s:d,s:d,s:d,s:i}", "bytes_written", disk_stats->bytes_written,
+                                    "write_seconds", disk_stats->write_seconds, "bands", norm_matrix->num_bands,
+                                    "bytes_read", disk_stats->bytes_read, "io_seconds", disk_stats->io_seconds,
+                                    "stream_seconds", disk_stats->stream_seconds, "passes", disk_stats->passes);
+    free_disk_affinity(norm_matrix);
+    if (!symnmf_matrix)
+    {
+        Py_XDECREF(stats);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to calculate SYMNMF");
+        return NULL;
+    }
+    if (!report)
+    {
+        return symnmf_result(symnmf_matrix, analysis);
+    }
+    return with_report(symnmf_result(symnmf_matrix, analysis), stats);
+}
+
+/* SymNMF on a Nystrom approximation of W built from `landmarks` points chosen by `method`
+ * ("uniform" or "kmeans++"). With report set the result comes back as (result, stats) with the
+ * rank and the approximation error on sampled pairs. */
+static PyObject *nystrom_symnmf(PyObject *self, PyObject *args)
+{
+    int vec_number, vec_dim, k, landmarks, analysis, rank = 0, report = 0;
+    double rms_error = 0.0, max_error = 0.0;
+    const char *method;
+    PyObject *X, *H0;
+
+    if (!PyArg_ParseTuple(args, "iiiOisOi|p", &k, &vec_number, &vec_dim, &X, &landmarks, &method, &H0, &analysis,
+                          &report))
     {
-        print_matrix(symnmf_matrix, vec_number, k);
-        Py_INCREF(Py_None);
-        result = Py_None;
+        return NULL;
+    }
+    if (strcmp(method, "uniform") != 0 && strcmp(method, "kmeans++") != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "landmark method must be 'uniform' or 'kmeans++'");
+        return NULL;
+    }
+
+    Matrix *d_points = matrix_parse(X, vec_number, vec_dim, 0);
+    if (!d_points)
+        return NULL;
+
+    Matrix *H_matrix = matrix_parse(H0, vec_number, k, 1);
+    int sampling = strcmp(method, "kmeans++") == 0 ? NYSTROM_KMEANSPP : NYSTROM_UNIFORM;
+    LowRankAffinity *norm_matrix = NULL;
+    Matrix *symnmf_matrix = NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    norm_matrix = H_matrix ? calc_nystrom_affinity(d_points, landmarks, sampling, 0) : NULL;
+    if (norm_matrix)
+    {
+        rank = norm_matrix->factor->cols;
+        if (report)
+        {
+            rms_error = nystrom_sample_error(norm_matrix, d_points, 10000, 1, &max_error);
+        }
+        scale_initial_h(H_matrix, lowrank_affinity_mean(norm_matrix), k);
+        symnmf_matrix = calc_symnmf_lowrank(norm_matrix, H_matrix);
     }
+    Py_END_ALLOW_THREADS
 
-    free_matrix_memory(H_matrix, vec_number);
-    free_matrix_memory(norm_matrix, vec_number);
-    free_matrix_memory(symnmf_matrix, vec_number);
+    free_lowrank_affinity(norm_matrix);
+    free_matrix_memory(H_matrix);
+    free_matrix_memory(d_points);
+    if (!norm_matrix)
+    {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Failed to build the Nystrom approximation");
+        return NULL;
+    }
+    if (!symnmf_matrix)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to calculate SYMNMF");
+        return NULL;
+    }
+    if (!report)
+    {
+        return symnmf_result(symnmf_matrix, analysis);
+    }
+    return with_report(symnmf_result(symnmf_matrix, analysis),
+                       Py_BuildValue("{s:i,s:i,s:d,s:d}", "rank", rank, "landmarks",
+                                     landmarks < vec_number ? landmarks : vec_number, "rms_error", rms_error,
+                                     "max_error", max_error));
+}
+
+/* Prints X (rows x cols) exactly as the C results are printed: "%.4f" text, or the binary format
+ * when an output file is set */
+static PyObject *py_print_matrix(PyObject *self, PyObject *args)
+{
+    int rows, cols;
+    PyObject *X;
 
+    if (!PyArg_ParseTuple(args, "iiO", &rows, &cols, &X))
+    {
+        return NULL;
+    }
+
+    Matrix *matrix = matrix_parse(X, rows, cols, 0);
+    if (!matrix)
+        return NULL;
+    int failed;
+    Py_BEGIN_ALLOW_THREADS
+    failed = print_matrix(matrix);
+    Py_END_ALLOW_THREADS
+    free_matrix_memory(matrix);
+    return printed(failed);
+}
+
+/* The whole SymNMF pipeline on X in C: W, the initial H seeded like numpy.random.seed(seed) and
+ * the solve, with only X going in and H and/or its labels coming out. output is "print" (H
+ * printed as by symnmf), "H", "labels" (a list of ints) or "both" (an (H, labels) tuple). */
+static PyObject *fit(PyObject *self, PyObject *args)
+{
+    int vec_number, vec_dim, k;
+    unsigned long seed = 0;
+    const char *output = "print";
+    PyObject *X;
+
+    if (!PyArg_ParseTuple(args, "iiiO|sk", &k, &vec_number, &vec_dim, &X, &output, &seed))
+    {
+        return NULL;
+    }
+    int want_h = strcmp(output, "H") == 0 || strcmp(output, "both") == 0;
+    int want_labels = strcmp(output, "labels") == 0 || strcmp(output, "both") == 0;
+    if (!want_h && !want_labels && strcmp(output, "print") != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "output must be 'print', 'H', 'labels' or 'both'");
+        return NULL;
+    }
+    if (k <= 0 || k > vec_number)
+    {
+        PyErr_SetString(PyExc_ValueError, "k must be between 1 and the number of points");
+        return NULL;
+    }
+
+    Matrix *d_points = matrix_parse(X, vec_number, vec_dim, 0);
+    if (!d_points)
+        return NULL;
+
+    int *labels = want_labels ? (int *)malloc(vec_number * sizeof(int)) : NULL;
+    Matrix *symnmf_matrix = NULL;
+    if (!want_labels || labels)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        symnmf_matrix = fit_symnmf(d_points, k, seed);
+        if (symnmf_matrix && labels)
+        {
+            calc_labels(symnmf_matrix, labels);
+        }
+        Py_END_ALLOW_THREADS
+    }
+    free_matrix_memory(d_points);
+    if (!symnmf_matrix)
+    {
+        free(labels);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to calculate SYMNMF");
+        return NULL;
+    }
+
+    PyObject *py_labels = NULL;
+    if (labels)
+    {
+        int i;
+        py_labels = PyList_New(vec_number);
+        for (i = 0; py_labels && i < vec_number; ++i)
+        {
+            PyObject *val = PyLong_FromLong(labels[i]);
+            if (!val)
+            {
+                Py_CLEAR(py_labels);
+                break;
+            }
+            PyList_SET_ITEM(py_labels, i, val);
+        }
+        free(labels);
+        if (!py_labels)
+        {
+            free_matrix_memory(symnmf_matrix);
+            return NULL;
+        }
+    }
+    if (!want_h)
+    {
+        if (py_labels)
+        {
+            free_matrix_memory(symnmf_matrix);
+            return py_labels;
+        }
+        return symnmf_result(symnmf_matrix, 0);
+    }
+
+    PyObject *py_h = build_mat_Python(symnmf_matrix);
+    if (!py_labels || !py_h)
+    {
+        Py_XDECREF(py_labels);
+        return py_h;
+    }
+    PyObject *result = PyTuple_Pack(2, py_h, py_labels);
+    Py_DECREF(py_h);
+    Py_DECREF(py_labels);
     return result;
 }
 
+/* Parses a CSV data-point file with the parallel C reader into a Matrix object */
+static PyObject *read_csv(PyObject *self, PyObject *args)
+{
+    const char *path;
+    if (!PyArg_ParseTuple(args, "s", &path))
+    {
+        return NULL;
+    }
+
+    Matrix *d_points;
+    Py_BEGIN_ALLOW_THREADS
+    d_points = parse_csv_file(path);
+    Py_END_ALLOW_THREADS
+    if (!d_points)
+    {
+        PyErr_SetString(PyExc_OSError, "Failed to read the data-point file");
+        return NULL;
+    }
+    return build_mat_Python(d_points);
+}
+
+/* Writes a CSV data-point file in the binary format */
+static PyObject *convert(PyObject *self, PyObject *args)
+{
+    const char *csv_path, *binary_path;
+    if (!PyArg_ParseTuple(args, "ss", &csv_path, &binary_path))
+    {
+        return NULL;
+    }
+    int failed;
+    Py_BEGIN_ALLOW_THREADS
+    failed = convert_to_binary(csv_path, binary_path);
+    Py_END_ALLOW_THREADS
+    if (failed)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to convert the data-point file");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* (rows, cols) of a binary data-point file, or None when the file is not in that format; with
+ * verify set, the data checksum is checked as well */
+static PyObject *binary_shape(PyObject *self, PyObject *args)
+{
+    const char *path;
+    int verify = 0;
+    if (!PyArg_ParseTuple(args, "s|p", &path, &verify))
+    {
+        return NULL;
+    }
+    if (!is_binary_matrix_file(path))
+    {
+        Py_RETURN_NONE;
+    }
+
+    Matrix *mapped;
+    Py_BEGIN_ALLOW_THREADS
+    mapped = map_binary_matrix(path, verify);
+    Py_END_ALLOW_THREADS
+    if (!mapped)
+    {
+        PyErr_SetString(PyExc_ValueError, "Corrupt binary data-point file");
+        return NULL;
+    }
+    PyObject *shape = Py_BuildValue("(ii)", mapped->rows, mapped->cols);
+    free_matrix_memory(mapped);
+    return shape;
+}
+
+static PyObject *py_set_num_threads(PyObject *self, PyObject *args)
+{
+    int num_threads;
+
+    if (!PyArg_ParseTuple(args, "i", &num_threads))
+    {
+        return NULL;
+    }
+
+    set_num_threads(num_threads);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_get_num_threads(PyObject *self, PyObject *args)
+{
+    return PyLong_FromLong(get_num_threads());
+}
+
+static PyObject *py_set_exp_mode(PyObject *self, PyObject *args)
+{
+    const char *mode;
+
+    if (!PyArg_ParseTuple(args, "s", &mode))
+    {
+        return NULL;
+    }
+    if (set_exp_mode(!strcmp(mode, "fast") ? EXP_FAST : !strcmp(mode, "strict") ? EXP_STRICT : -1) != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "exp mode must be 'strict' or 'fast'");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_set_precision(PyObject *self, PyObject *args)
+{
+    const char *mode;
+    if (!PyArg_ParseTuple(args, "s", &mode))
+    {
+        return NULL;
+    }
+    if (strcmp(mode, "double") != 0 && strcmp(mode, "mixed") != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "precision must be 'double' or 'mixed'");
+        return NULL;
+    }
+
+    set_precision(strcmp(mode, "mixed") == 0 ? PRECISION_MIXED : PRECISION_DOUBLE);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_set_output_file(PyObject *self, PyObject *args)
+{
+    const char *file_name;
+    if (!PyArg_ParseTuple(args, "z", &file_name))
+    {
+        return NULL;
+    }
+    if (set_output_file(file_name) != 0)
+    {
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef symnmf_methods[] = {
     {"similarity_matrix", (PyCFunction)similarity_matrix, METH_VARARGS, "Compute similarity matrix"},
     {"diagonal_matrix", (PyCFunction)diagonal_matrix, METH_VARARGS, "Compute diagonal degree matrix"},
+    {"degree_vector", (PyCFunction)degree_vector, METH_VARARGS, "Compute the degree of every data point as an n x 1 Matrix object"},
     {"norm_matrix", (PyCFunction)norm_matrix, METH_VARARGS, "Compute normalized similarity matrix"},
     {"symnmf", (PyCFunction)symnmf, METH_VARARGS, "Perform SYMNMF algorithm"},
+    {"knn_symnmf", (PyCFunction)knn_symnmf, METH_VARARGS, "Perform SYMNMF on the sparse k-nearest-neighbor affinity graph"},
+    {"radius_symnmf", (PyCFunction)radius_symnmf, METH_VARARGS, "Perform SYMNMF on the affinities above a tolerance"},
+    {"implicit_symnmf", (PyCFunction)implicit_symnmf, METH_VARARGS, "Perform SYMNMF without storing the normalized similarity matrix"},
+    {"disk_symnmf", (PyCFunction)disk_symnmf, METH_VARARGS, "Perform SYMNMF with the normalized similarity matrix streamed from a file within a memory budget in MB; with report=True also return its I/O statistics"},
+    {"nystrom_symnmf", (PyCFunction)nystrom_symnmf, METH_VARARGS, "Perform SYMNMF on a Nystrom low-rank approximation of the normalized similarity matrix; with report=True also return its rank and sampled error"},
+    {"fit", (PyCFunction)fit, METH_VARARGS, "Run SYMNMF from data points to H and/or labels without W leaving C"},
+    {"read_csv", (PyCFunction)read_csv, METH_VARARGS, "Read a CSV data-point file into a Matrix object"},
+    {"convert", (PyCFunction)convert, METH_VARARGS, "Convert a CSV data-point file to the binary format"},
+    {"binary_shape", (PyCFunction)binary_shape, METH_VARARGS, "Get (rows, cols) of a binary data-point file, or None for CSV"},
+    {"set_num_threads", (PyCFunction)py_set_num_threads, METH_VARARGS, "Set the worker pool size (0 picks the number of cores)"},
+    {"get_num_threads", (PyCFunction)py_get_num_threads, METH_NOARGS, "Get the worker pool size"},
+    {"set_exp_mode", (PyCFunction)py_set_exp_mode, METH_VARARGS, "Select the affinity exp accuracy: 'strict' or 'fast'"},
+    {"set_precision", (PyCFunction)py_set_precision, METH_VARARGS, "Store W as 'double' or in float with double accumulation ('mixed')"},
+    {"print_matrix", (PyCFunction)py_print_matrix, METH_VARARGS, "Print a matrix in the output format of the results"},
+    {"set_output_file", (PyCFunction)py_set_output_file, METH_VARARGS, "Write printed matrices to a binary file instead of stdout (None restores text)"},
     {NULL, NULL, 0, NULL}};
 
 static struct PyModuleDef moduledef = {
     PyModuleDef_HEAD_INIT,
-    "mysymnmf",
+    "symnmfmodule",
     "A Python module for SYMNMF algorithm",
     -1,
     symnmf_methods};
 
-PyMODINIT_FUNC PyInit_mysymnmf(void)
+PyMODINIT_FUNC PyInit_symnmfmodule(void)
 {
-    return PyModule_Create(&moduledef);
+    if (PyType_Ready(&SymnmfMatrixType) < 0)
+        return NULL;
+    /* The settings read lazily from the environment are resolved here, under the GIL, so calls
+     * running with the GIL released never race on their first read */
+    get_exp_mode();
+    get_precision();
+    get_output_file();
+    PyObject *module = PyModule_Create(&moduledef);
+    if (!module)
+        return NULL;
+    Py_INCREF(&SymnmfMatrixType);
+    if (PyModule_AddObject(module, "Matrix", (PyObject *)&SymnmfMatrixType) < 0)
+    {
+        Py_DECREF(&SymnmfMatrixType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }
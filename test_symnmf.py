@@ -0,0 +1,593 @@
+import ctypes
+import os
+import sys
+import tempfile
+import threading
+import unittest
+from math import sqrt
+import numpy as np
+import symnmfmodule
+
+
+def blobs(n, d, centers, seed):
+    rng = np.random.RandomState(seed)
+    means = rng.uniform(-4, 4, size=(centers, d))
+    return (means[np.arange(n) % centers] + rng.normal(0, 0.6, size=(n, d))).tolist()
+
+
+def baseline_similarity(points):
+    X = np.asarray(points, dtype=np.float64)
+    A = np.exp(-0.5 * ((X[:, None, :] - X[None, :, :]) ** 2).sum(axis=2))
+    np.fill_diagonal(A, 0.0)
+    return A
+
+
+def baseline_norm(points):
+    A = baseline_similarity(points)
+    scale = 1 / np.sqrt(A.sum(axis=1))
+    return scale[:, None] * A * scale[None, :]
+
+
+def baseline_symnmf(W, H0):
+    """The original update and stopping rule: at most 300 updates, until ||H' - H||_F^2 < 1e-4"""
+    W = np.asarray(W, dtype=np.float64)
+
+    def update(H):
+        return H * (0.5 * (W @ H) / ((H @ H.T) @ H) + 0.5)
+
+    H = np.array(H0, dtype=np.float64)
+    next_h = update(H)
+    for _ in range(300):
+        if np.sum((next_h - H) ** 2) < 1e-4:
+            break
+        H, next_h = next_h, update(next_h)
+    return next_h
+
+
+def formatted(values):
+    return "".join(",".join("%.4f" % x for x in row) + "\n" for row in values)
+
+
+def captured(function, *args):
+    """What a C entry point writes to stdout, C stdio buffer included"""
+    sys.stdout.flush()
+    saved = os.dup(1)
+    with tempfile.TemporaryFile() as out:
+        os.dup2(out.fileno(), 1)
+        try:
+            function(*args)
+            ctypes.CDLL(None).fflush(None)
+        finally:
+            os.dup2(saved, 1)
+            os.close(saved)
+        out.seek(0)
+        return out.read().decode()
+
+
+def solve(points, k, precision):
+    n, d = len(points), len(points[0])
+    symnmfmodule.set_precision("double")
+    W = symnmfmodule.norm_matrix(0, n, d, points)
+    np.random.seed(0)
+    H0 = np.random.uniform(0, 2 * sqrt(np.mean(W) / k), size=(n, k)).tolist()
+    symnmfmodule.set_precision(precision)
+    try:
+        return np.array(symnmfmodule.symnmf(k, n, W, H0, 1))
+    finally:
+        symnmfmodule.set_precision("double")
+
+
+class BaselineTest(unittest.TestCase):
+    """The dense pipeline against a NumPy transcription of the original C code"""
+
+    def assertMatchesBaseline(self, points, k, tolerance=1e-10):
+        n, d = len(points), len(points[0])
+        expected_W = baseline_norm(points)
+        W = np.asarray(symnmfmodule.norm_matrix(0, n, d, points))
+        self.assertLess(np.max(np.abs(W - expected_W)), 1e-14)
+        H0 = np.random.RandomState(n + k).uniform(0, 2 * sqrt(np.mean(expected_W) / k), size=(n, k))
+        H = np.asarray(symnmfmodule.symnmf(k, n, W.tolist(), H0.tolist(), 1))
+        self.assertLess(np.max(np.abs(H - baseline_symnmf(expected_W, H0))), tolerance)
+
+    def test_row_padding(self):
+        # rows shorter than, equal to and longer than one 64-byte line
+        for n, d, k in ((2, 1, 1), (7, 3, 2), (8, 8, 8), (45, 11, 3)):
+            self.assertMatchesBaseline(blobs(n, d, min(n, 3), n), k)
+
+    def test_gram_denominator(self):
+        for k in (1, 2, 5, 9):
+            self.assertMatchesBaseline(blobs(90, 4, 3, k), k)
+
+    def test_gemm_block_edges(self):
+        # n crosses the MC and KC blocks and leaves partial 8 x 4 tiles
+        self.assertMatchesBaseline(blobs(301, 2, 4, 3), 7)
+
+    def test_diagonal_scaling(self):
+        points = blobs(150, 3, 3, 4)
+        W = np.asarray(symnmfmodule.norm_matrix(0, 150, 3, points))
+        self.assertLess(np.max(np.abs(W - baseline_norm(points))), 1e-15)
+        self.assertLess(np.max(np.abs(W - W.T)), 1e-16)
+        self.assertTrue(np.all(np.diag(W) == 0))
+
+    def test_degree_vector(self):
+        points = blobs(120, 4, 3, 5)
+        expected = baseline_similarity(points).sum(axis=1)
+        degrees = np.asarray(symnmfmodule.degree_vector(120, 4, points))
+        self.assertEqual(degrees.shape, (120, 1))
+        degrees = degrees[:, 0]
+        self.assertLess(np.max(np.abs(degrees - expected) / expected), 1e-13)
+        self.assertEqual(captured(symnmfmodule.diagonal_matrix, 120, 4, points), formatted(np.diag(expected)))
+
+    def test_packed_storage(self):
+        points = blobs(60, 3, 3, 6)
+        self.assertEqual(captured(symnmfmodule.similarity_matrix, 60, 3, points), formatted(baseline_similarity(points)))
+        self.assertEqual(captured(symnmfmodule.norm_matrix, 1, 60, 3, points), formatted(baseline_norm(points)))
+
+        # only the upper triangle of the W handed in is read
+        W = np.asarray(symnmfmodule.norm_matrix(0, 60, 3, points))
+        H0 = np.random.RandomState(6).uniform(0, 0.5, size=(60, 3)).tolist()
+        garbage = np.triu(W) + np.tril(np.random.RandomState(7).uniform(-5, 5, size=(60, 60)), -1)
+        H = np.asarray(symnmfmodule.symnmf(3, 60, W.tolist(), H0, 1))
+        self.assertTrue(np.array_equal(H, np.asarray(symnmfmodule.symnmf(3, 60, garbage.tolist(), H0, 1))))
+        self.assertLess(np.max(np.abs(H - baseline_symnmf(baseline_norm(points), H0))), 1e-10)
+
+
+class ThreadPoolTest(unittest.TestCase):
+    """Results across pool sizes; the pool is restored after each test"""
+
+    def setUp(self):
+        self.threads = symnmfmodule.get_num_threads()
+
+    def tearDown(self):
+        symnmfmodule.set_num_threads(self.threads)
+
+    def test_w_independent_of_thread_count(self):
+        points = blobs(500, 3, 4, 11)
+        results = []
+        for threads in (1, 2, 4, 7):
+            symnmfmodule.set_num_threads(threads)
+            self.assertEqual(symnmfmodule.get_num_threads(), threads)
+            results.append((np.asarray(symnmfmodule.norm_matrix(0, 500, 3, points)),
+                            np.asarray(symnmfmodule.degree_vector(500, 3, points))))
+        for W, degrees in results[1:]:
+            self.assertTrue(np.array_equal(W, results[0][0]))
+            self.assertTrue(np.array_equal(degrees, results[0][1]))
+        self.assertLess(np.max(np.abs(results[0][0] - baseline_norm(points))), 1e-15)
+
+    def test_iteration_across_thread_counts(self):
+        points = blobs(400, 3, 4, 12)
+        W = symnmfmodule.norm_matrix(0, 400, 3, points)
+        H0 = np.random.RandomState(12).uniform(0, 0.3, size=(400, 4)).tolist()
+        expected = baseline_symnmf(W, H0)
+        for threads in (1, 3, 4):
+            symnmfmodule.set_num_threads(threads)
+            H = np.asarray(symnmfmodule.symnmf(4, 400, W, H0, 1))
+            self.assertLess(np.max(np.abs(H - expected)), 1e-10)
+            self.assertTrue(np.array_equal(H, np.asarray(symnmfmodule.symnmf(4, 400, W, H0, 1))))
+
+
+class KernelTest(unittest.TestCase):
+    """The distance, exp and GEMM-distance kernels against the baseline W"""
+
+    def assertCloseToBaseline(self, points, relative):
+        n, d = len(points), len(points[0])
+        expected = baseline_norm(points)
+        W = np.asarray(symnmfmodule.norm_matrix(0, n, d, points))
+        self.assertTrue(np.allclose(W, expected, rtol=relative, atol=0))
+
+    def test_distance_kernel_widths(self):
+        # register-held query points up to d = 8 and 16, then the general loop with its tails
+        for d in (1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 33):
+            self.assertCloseToBaseline(blobs(40, d, 3, d), 1e-12)
+
+    def test_exp_modes(self):
+        # the last cluster lies far enough away that its cross affinities underflow to zero
+        points = np.array(blobs(80, 3, 3, 10))
+        points[60:, 0] += 100
+        points = points.tolist()
+        try:
+            symnmfmodule.set_exp_mode("strict")
+            self.assertCloseToBaseline(points, 1e-13)
+            symnmfmodule.set_exp_mode("fast")
+            self.assertCloseToBaseline(points, 1e-7)
+        finally:
+            symnmfmodule.set_exp_mode("strict")
+
+    def test_unknown_exp_mode(self):
+        with self.assertRaises(ValueError):
+            symnmfmodule.set_exp_mode("exact")
+
+    def test_gemm_distance_identity(self):
+        # d = 127 stays on the direct kernels; the duplicated rows exercise the cancellation fallback
+        rng = np.random.RandomState(13)
+        for d in (127, 128, 300):
+            points = rng.normal(0, 0.08, size=(150, d))
+            points[1] = points[0] + 1e-9
+            points[3] = points[2]
+            self.assertCloseToBaseline(points.tolist(), 1e-12)
+
+
+class WorkspaceTest(unittest.TestCase):
+    """Solves of different shapes back to back, each against the baseline update"""
+
+    def setUp(self):
+        self.threads = symnmfmodule.get_num_threads()
+
+    def tearDown(self):
+        symnmfmodule.set_num_threads(self.threads)
+
+    def factor(self, points, k, seed):
+        n, d = len(points), len(points[0])
+        W = symnmfmodule.norm_matrix(0, n, d, points)
+        H0 = np.random.RandomState(seed).uniform(0, 0.5, size=(n, k)).tolist()
+        return np.asarray(symnmfmodule.symnmf(k, n, W, H0, 1)), baseline_symnmf(W, H0)
+
+    def test_shapes_in_sequence(self):
+        first = None
+        for n, k in ((50, 2), (200, 6), (13, 1), (200, 6)):
+            H, expected = self.factor(blobs(n, 3, 3, n), k, k)
+            self.assertLess(np.max(np.abs(H - expected)), 1e-10)
+            if n == 200:
+                if first is None:
+                    first = H
+                else:
+                    self.assertTrue(np.array_equal(H, first))
+
+    def test_more_threads_than_rows(self):
+        symnmfmodule.set_num_threads(8)
+        H, expected = self.factor(blobs(5, 2, 2, 14), 2, 14)
+        self.assertLess(np.max(np.abs(H - expected)), 1e-10)
+
+    def test_fused_convergence(self):
+        # a warm start from a converged factor stops after a handful of updates, as the baseline does
+        points = blobs(180, 3, 3, 15)
+        W = symnmfmodule.norm_matrix(0, 180, 3, points)
+        H0 = np.random.RandomState(15).uniform(0, 0.5, size=(180, 3)).tolist()
+        H = symnmfmodule.symnmf(3, 180, W, H0, 1)
+        warm = np.asarray(symnmfmodule.symnmf(3, 180, W, np.asarray(H).tolist(), 1))
+        self.assertLess(np.max(np.abs(warm - baseline_symnmf(W, np.asarray(H)))), 1e-12)
+
+
+class SolverModeTest(unittest.TestCase):
+    """Each alternative W storage against the dense solve from the same unit H0, which every mode
+    scales by 2 * sqrt(mean(W) / k) itself"""
+
+    n, d, k = 120, 3, 3
+
+    @classmethod
+    def setUpClass(cls):
+        cls.points = blobs(cls.n, cls.d, cls.k, 7)
+        cls.H_unit = np.random.RandomState(2).uniform(0, 1, size=(cls.n, cls.k)).tolist()
+        W = symnmfmodule.norm_matrix(0, cls.n, cls.d, cls.points)
+        H0 = np.asarray(cls.H_unit) * 2 * sqrt(np.mean(W) / cls.k)
+        cls.reference = np.asarray(symnmfmodule.symnmf(cls.k, cls.n, W, H0.tolist(), 1))
+
+    def assertMatchesDense(self, H, tolerance=1e-12):
+        self.assertLess(np.max(np.abs(np.asarray(H) - self.reference)), tolerance)
+
+    def test_knn_with_every_neighbor(self):
+        n, d, k = self.n, self.d, self.k
+        self.assertMatchesDense(symnmfmodule.knn_symnmf(k, n, d, self.points, n - 1, self.H_unit, 1))
+
+    def test_knn_matches_exhaustive_search(self):
+        # integer coordinates give exact distances and many ties, which go to the smaller index
+        n, d, k, neighbors = self.n, self.d, self.k, 6
+        points = np.round(np.asarray(self.points))
+        distances = ((points[:, None, :] - points[None, :, :]) ** 2).sum(axis=2)
+        keep = np.zeros((n, n), dtype=bool)
+        for i in range(n):
+            order = [j for j in np.lexsort((np.arange(n), distances[i])) if j != i]
+            keep[i, order[:neighbors]] = True
+        A = np.where(keep | keep.T, baseline_similarity(points), 0.0)
+        scale = 1 / np.sqrt(A.sum(axis=1))
+        W = scale[:, None] * A * scale[None, :]
+        expected = baseline_symnmf(W, np.asarray(self.H_unit) * 2 * sqrt(np.mean(W) / k))
+        H = symnmfmodule.knn_symnmf(k, n, d, points.tolist(), neighbors, self.H_unit, 1)
+        self.assertLess(np.max(np.abs(np.asarray(H) - expected)), 1e-10)
+
+    def test_radius_below_every_affinity(self):
+        # the blobs lie in [-4, 4]^3 plus noise, so every affinity is far above 1e-200
+        n, d, k = self.n, self.d, self.k
+        self.assertMatchesDense(symnmfmodule.radius_symnmf(k, n, d, self.points, 1e-200, self.H_unit, 1))
+
+    def test_implicit(self):
+        n, d, k = self.n, self.d, self.k
+        self.assertMatchesDense(symnmfmodule.implicit_symnmf(k, n, d, self.points, self.H_unit, 1))
+
+    def test_disk_within_budget(self):
+        n, d, k = self.n, self.d, self.k
+        fd, path = tempfile.mkstemp(suffix=".symnmfw")
+        os.close(fd)
+        try:
+            # 0.05 MB: W is streamed in several bands
+            self.assertMatchesDense(symnmfmodule.disk_symnmf(k, n, d, self.points, path, 0.05, self.H_unit, 1))
+            H, stats = symnmfmodule.disk_symnmf(k, n, d, self.points, path, 0.05, self.H_unit, 1, True)
+            self.assertMatchesDense(H)
+            self.assertEqual(stats["bytes_written"], n * (n + 1) / 2 * 8)
+            self.assertEqual(stats["bytes_read"], stats["passes"] * stats["bytes_written"])
+            self.assertGreater(stats["bands"], 1)
+            # too small for two rows of W once the product partials have their share
+            with self.assertRaises(RuntimeError):
+                symnmfmodule.disk_symnmf(k, n, d, self.points, path, 0.001, self.H_unit, 1)
+        finally:
+            os.remove(path)
+
+    def test_nystrom_with_every_landmark(self):
+        # m = n makes the approximation exact up to the eigenvalue cutoff
+        n, d, k = self.n, self.d, self.k
+        self.assertMatchesDense(symnmfmodule.nystrom_symnmf(k, n, d, self.points, n, "uniform", self.H_unit, 1), 1e-10)
+        self.assertMatchesDense(symnmfmodule.nystrom_symnmf(k, n, d, self.points, n, "kmeans++", self.H_unit, 1), 1e-10)
+        H, stats = symnmfmodule.nystrom_symnmf(k, n, d, self.points, n, "uniform", self.H_unit, 1, True)
+        self.assertMatchesDense(H, 1e-10)
+        self.assertEqual(stats["landmarks"], n)
+        self.assertLessEqual(stats["rank"], n)
+        self.assertLess(stats["rms_error"], 1e-6)
+        self.assertLess(stats["max_error"], 1e-6)
+
+
+class CsvReaderTest(unittest.TestCase):
+    """The parallel C reader against numpy.loadtxt"""
+
+    def assertReadsLikeNumpy(self, text):
+        fd, path = tempfile.mkstemp(suffix=".txt")
+        os.write(fd, text.encode())
+        os.close(fd)
+        try:
+            expected = np.loadtxt(path, delimiter=",", ndmin=2)
+            actual = np.asarray(symnmfmodule.read_csv(path))
+        finally:
+            os.remove(path)
+        self.assertEqual(actual.shape, expected.shape)
+        self.assertTrue(np.array_equal(actual, expected))
+
+    def test_exponents_and_long_mantissas(self):
+        # the long mantissas and the subnormal take the strtod fallback
+        self.assertReadsLikeNumpy("1.5e3,-2.25E-4,7\n"
+                                  "3.14159265358979323846264,0.1000000000000000055511151231257827,-1e-310\n"
+                                  "123456789012345678901234,4.9e-324,1.7976931348623157e308\n")
+
+    def test_no_trailing_newline(self):
+        self.assertReadsLikeNumpy("1,2\n3,4")
+
+    def test_crlf(self):
+        self.assertReadsLikeNumpy("1.25,2\r\n3,4.5\r\n")
+
+    def test_empty_fields_rejected(self):
+        for text in ("1,,2\n3,4,5\n", "1,2,3\n4,5,\n", "1,2\n,3\n", "1, ,2\n"):
+            fd, path = tempfile.mkstemp(suffix=".txt")
+            os.write(fd, text.encode())
+            os.close(fd)
+            try:
+                with self.assertRaises(OSError):
+                    symnmfmodule.read_csv(path)
+            finally:
+                os.remove(path)
+
+    def test_independent_of_numeric_locale(self):
+        # the strtod fallback must keep '.' as the decimal point under a ',' locale
+        import locale
+        saved = locale.setlocale(locale.LC_NUMERIC)
+        for name in ("de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "ru_RU.UTF-8"):
+            try:
+                locale.setlocale(locale.LC_NUMERIC, name)
+                break
+            except locale.Error:
+                continue
+        else:
+            self.skipTest("no locale with a ',' decimal point is installed")
+        try:
+            self.assertReadsLikeNumpy("3.14159265358979323846264,1e-310\n0.1000000000000000055511151231257827,2\n")
+        finally:
+            locale.setlocale(locale.LC_NUMERIC, saved)
+
+    def test_chunks_across_workers(self):
+        rng = np.random.RandomState(0)
+        values = rng.uniform(-1e3, 1e3, size=(5000, 7)) * 10.0 ** rng.randint(-8, 8, size=(5000, 7))
+        text = "\n".join(",".join(repr(float(v)) for v in row) for row in values) + "\n"
+        threads = symnmfmodule.get_num_threads()
+        symnmfmodule.set_num_threads(4)
+        try:
+            self.assertReadsLikeNumpy(text)
+        finally:
+            symnmfmodule.set_num_threads(threads)
+
+
+class OutputTest(unittest.TestCase):
+    """Printed matrices against Python's "%.4f" and the binary output mode"""
+
+    @staticmethod
+    def capture(values):
+        values = np.asarray(values, dtype=np.float64)
+        return captured(symnmfmodule.print_matrix, values.shape[0], values.shape[1], values.tolist())
+
+    def test_edge_values(self):
+        values = [[-0.0, 0.0, 0.99995, 1.99995, 9.99995, -0.99995],
+                  [0.00005, -0.00005, 0.00015, 0.03125, -0.03125, 2.5],
+                  [1e-320, -1e-320, 0.49999999999999994, 99999999999.99995, 1e11, -1e11],
+                  [123456789.12345, 1e15, -1e20, 1.7976931348623157e308, float("inf"), float("-inf")]]
+        self.assertEqual(self.capture(values), formatted(values))
+
+    def test_random_values_across_batches(self):
+        rng = np.random.RandomState(1)
+        values = rng.uniform(-2, 2, size=(1100, 1000)) * 10.0 ** rng.randint(-6, 6, size=(1100, 1000))
+        threads = symnmfmodule.get_num_threads()
+        symnmfmodule.set_num_threads(4)
+        try:
+            self.assertEqual(self.capture(values), formatted(values))
+        finally:
+            symnmfmodule.set_num_threads(threads)
+
+    def test_binary_output_round_trip(self):
+        values = np.random.RandomState(2).uniform(-1, 1, size=(7, 11))
+        fd, path = tempfile.mkstemp(suffix=".bin")
+        os.close(fd)
+        symnmfmodule.set_output_file(path)
+        try:
+            symnmfmodule.print_matrix(7, 11, values.tolist())
+        finally:
+            symnmfmodule.set_output_file(None)
+        try:
+            self.assertEqual(symnmfmodule.binary_shape(path, True), (7, 11))
+            rows, cols, stride = np.fromfile(path, dtype=np.int32, count=3, offset=8)
+            data = np.fromfile(path, dtype=np.float64, offset=64).reshape(rows, stride)[:, :cols]
+            self.assertTrue(np.array_equal(data, values))
+        finally:
+            os.remove(path)
+
+    def test_write_failure_raises(self):
+        points = blobs(20, 2, 2, 3)
+        symnmfmodule.set_output_file(os.path.join(tempfile.gettempdir(), "missing-directory", "out.bin"))
+        try:
+            for function, args in ((symnmfmodule.print_matrix, (2, 2, [[1.0, 2.0], [3.0, 4.0]])),
+                                   (symnmfmodule.similarity_matrix, (20, 2, points)),
+                                   (symnmfmodule.diagonal_matrix, (20, 2, points)),
+                                   (symnmfmodule.norm_matrix, (1, 20, 2, points)),
+                                   (symnmfmodule.fit, (2, 20, 2, points, "print"))):
+                with self.assertRaises(OSError):
+                    function(*args)
+        finally:
+            symnmfmodule.set_output_file(None)
+
+
+class BinaryFormatTest(unittest.TestCase):
+    """CSV to binary conversion, mapping and checksum verification"""
+
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        self.csv = os.path.join(self.directory, "points.txt")
+        self.binary = os.path.join(self.directory, "points.bin")
+        np.savetxt(self.csv, np.array(blobs(150, 9, 3, 8)), fmt="%.6f", delimiter=",")
+        symnmfmodule.convert(self.csv, self.binary)
+
+    def tearDown(self):
+        for path in (self.csv, self.binary):
+            os.remove(path)
+        os.rmdir(self.directory)
+
+    def test_round_trip(self):
+        self.assertIsNone(symnmfmodule.binary_shape(self.csv))
+        self.assertEqual(symnmfmodule.binary_shape(self.binary, True), (150, 9))
+        points = np.loadtxt(self.csv, delimiter=",").tolist()
+        W_csv = np.asarray(symnmfmodule.norm_matrix(0, 150, 9, points))
+        W_binary = np.asarray(symnmfmodule.norm_matrix(0, 150, 9, self.binary))
+        self.assertTrue(np.array_equal(W_csv, W_binary))
+
+    def test_fit_round_trip(self):
+        points = symnmfmodule.read_csv(self.csv)
+        H_csv, labels_csv = symnmfmodule.fit(3, 150, 9, points, "both")
+        H_binary, labels_binary = symnmfmodule.fit(3, 150, 9, self.binary, "both")
+        self.assertTrue(np.array_equal(np.asarray(H_csv), np.asarray(H_binary)))
+        self.assertEqual(labels_csv, labels_binary)
+
+    def test_corruption_detected(self):
+        with open(self.binary, "r+b") as f:
+            f.seek(64 + 8 * 20 + 3)
+            byte = f.read(1)
+            f.seek(-1, os.SEEK_CUR)
+            f.write(bytes([byte[0] ^ 0x10]))
+        self.assertEqual(symnmfmodule.binary_shape(self.binary), (150, 9))
+        with self.assertRaises(ValueError):
+            symnmfmodule.binary_shape(self.binary, True)
+        # every load path verifies the checksum
+        with self.assertRaises(ValueError):
+            symnmfmodule.norm_matrix(0, 150, 9, self.binary)
+
+    def test_header_must_match_file_size(self):
+        # 2142827808 * 1076074802 * 8 = 2^64 + 512: in 64 bits the forged header claims exactly the
+        # 512 data bytes that follow it
+        with open(self.binary, "wb") as f:
+            f.write(b"SYMNMFX1" + np.array([2142827808, 9, 1076074802, 1], dtype=np.int32).tobytes())
+            f.write(bytes(64 - 24) + bytes(512))
+        with self.assertRaises(ValueError):
+            symnmfmodule.binary_shape(self.binary)
+
+
+class MixedPrecisionTest(unittest.TestCase):
+    """W stored in float with double accumulation against the all-double reference"""
+
+    def test_factor_matches_double(self):
+        points = blobs(300, 5, 4, 1)
+        reference = solve(points, 4, "double")
+        mixed = solve(points, 4, "mixed")
+        self.assertLess(np.max(np.abs(reference - mixed)), 1e-4)
+
+    def test_labels_match_double(self):
+        points = blobs(500, 3, 5, 2)
+        reference = solve(points, 5, "double").argmax(axis=1)
+        mixed = solve(points, 5, "mixed").argmax(axis=1)
+        self.assertTrue(np.array_equal(reference, mixed))
+
+
+class BufferInterfaceTest(unittest.TestCase):
+    """NumPy arrays in, C-owned buffers out, with nested lists as the slow fallback"""
+
+    def test_inputs_agree(self):
+        points = np.array(blobs(200, 4, 3, 3))
+        W = symnmfmodule.norm_matrix(0, 200, 4, points)
+        self.assertTrue(np.array_equal(np.asarray(W), np.asarray(symnmfmodule.norm_matrix(0, 200, 4, points.tolist()))))
+        self.assertTrue(np.array_equal(np.asarray(W), np.asarray(symnmfmodule.norm_matrix(0, 200, 4, np.asfortranarray(points)))))
+        single = np.asarray(symnmfmodule.norm_matrix(0, 200, 4, points.astype(np.float32)))
+        self.assertLess(np.max(np.abs(np.asarray(W) - single)), 1e-6)
+
+        H0 = np.random.RandomState(0).uniform(0, 0.5, size=(200, 3))
+        H = np.asarray(symnmfmodule.symnmf(3, 200, W, H0, 1))
+        from_lists = np.asarray(symnmfmodule.symnmf(3, 200, np.asarray(W).tolist(), H0.tolist(), 1))
+        self.assertLess(np.max(np.abs(H - from_lists)), 1e-12)
+        self.assertTrue(np.array_equal(H0, np.random.RandomState(0).uniform(0, 0.5, size=(200, 3))))
+
+    def test_result_is_shared(self):
+        W = symnmfmodule.norm_matrix(0, 50, 2, blobs(50, 2, 2, 4))
+        self.assertEqual(W.shape, (50, 50))
+        self.assertTrue(np.shares_memory(np.asarray(W), np.asarray(W)))
+        with self.assertRaises(ValueError):
+            symnmfmodule.norm_matrix(0, 50, 3, np.asarray(W))
+
+
+class ConcurrencyTest(unittest.TestCase):
+    """Factorizations running in several Python threads, each with the GIL released"""
+
+    def test_threads_match_sequential(self):
+        points = np.array(blobs(400, 3, 4, 5))
+        H0 = np.random.RandomState(1).uniform(0, 0.3, size=(400, 4))
+        reference = np.asarray(symnmfmodule.symnmf(4, 400, symnmfmodule.norm_matrix(0, 400, 3, points), H0, 1))
+        results = [None] * 4
+
+        def run(i):
+            W = symnmfmodule.norm_matrix(0, 400, 3, points)
+            results[i] = np.asarray(symnmfmodule.symnmf(4, 400, W, H0, 1))
+
+        threads = [threading.Thread(target=run, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for result in results:
+            self.assertTrue(np.array_equal(result, reference))
+
+
+class FitTest(unittest.TestCase):
+    """fit() against the Python-side pipeline it replaces"""
+
+    def test_matches_python_pipeline(self):
+        points = blobs(300, 4, 3, 6)
+        reference = solve(points, 3, "double")
+        H, labels = symnmfmodule.fit(3, 300, 4, np.array(points), "both", 0)
+        self.assertLess(np.max(np.abs(np.asarray(H) - reference)), 1e-12)
+        self.assertEqual(labels, reference.argmax(axis=1).tolist())
+        self.assertEqual(symnmfmodule.fit(3, 300, 4, points, "labels"), labels)
+
+    def test_double_and_mixed_agree(self):
+        points = np.array(blobs(400, 3, 4, 9))
+        H_double, labels_double = symnmfmodule.fit(4, 400, 3, points, "both", 0)
+        symnmfmodule.set_precision("mixed")
+        try:
+            H_mixed, labels_mixed = symnmfmodule.fit(4, 400, 3, points, "both", 0)
+        finally:
+            symnmfmodule.set_precision("double")
+        self.assertLess(np.max(np.abs(np.asarray(H_double) - np.asarray(H_mixed))), 1e-4)
+        self.assertEqual(labels_double, labels_mixed)
+        self.assertLess(np.max(np.abs(np.asarray(H_double) - solve(points.tolist(), 4, "double"))), 1e-12)
+
+
+if __name__ == "__main__":
+    unittest.main()